@@ -0,0 +1,385 @@
+/*-----------------------------------------------------------------------------
+ * bench.c
+ *
+ * End-to-end latency benchmark for gpio_button. A GPIO output, driven with
+ * blinky's line handle (../blinky/gpio_output.c), is wired to the button
+ * input (GPIO 24). Every edge written is timestamped, and every event read
+ * back from /dev/gpio_button is matched to the edge that caused it.
+ *
+ * Reports p50/p99/p99.9/max latency from the write to read() returning, the
+ * driver side part of it (hard IRQ timestamp to read()), the event rate that
+ * was sustained, and events lost on the way.
+ *-----------------------------------------------------------------------------
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "gpio_output.h"
+#include "gpio_button.h"
+
+#define GPIO_BUTTON_DEVICE   "/dev/gpio_button"
+#define DEFAULT_OUTPUT_PIN   23
+#define DEFAULT_EDGES        1000
+#define DEFAULT_INTERVAL_US  100000     // must exceed the driver's debounce_us
+#define IDLE_TIMEOUT_MS      500        // reader gives up this long after the last edge
+#define NSEC_PER_SEC         1000000000LL
+#define NSEC_PER_USEC        1000LL
+
+struct bench_config {
+    struct gpio_output out;
+    const char *device;
+    long edges;
+    long interval_us;
+    long jitter_us;
+};
+
+// One run: edges[] is filled by the writer, latencies by the reader
+struct bench_run {
+    struct bench_config *cfg;
+    long interval_us;
+    int64_t *edge_ns;           // CLOCK_MONOTONIC time each edge was written
+    int64_t *e2e_ns;            // write to read() returning
+    int64_t *irq_ns;            // hard IRQ timestamp to read() returning
+    long received;
+    long ring_lost;             // sequence gaps seen by the reader
+    int64_t last_read_ns;
+    long edges_written;         // published with release after edge_ns[]
+    bool writer_done;
+};
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void ns_to_timespec(int64_t ns, struct timespec *ts)
+{
+    ts->tv_sec = ns / NSEC_PER_SEC;
+    ts->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+// Toggle the line on absolute deadlines, interval +/- a uniform jitter
+static void *writer_thread(void *arg)
+{
+    struct bench_run *run = arg;
+    struct bench_config *cfg = run->cfg;
+    unsigned int seed = (unsigned int)now_ns();
+    struct timespec ts;
+    int64_t deadline = now_ns() + run->interval_us * NSEC_PER_USEC;
+    int64_t offset;
+    long i;
+
+    for (i = 0; i < cfg->edges; i++) {
+        offset = 0;
+        if (cfg->jitter_us)
+            offset = (rand_r(&seed) % (2 * cfg->jitter_us + 1)) - cfg->jitter_us;
+
+        ns_to_timespec(deadline + offset * NSEC_PER_USEC, &ts);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+
+        // Even edges pull the active-low button input down (press)
+        run->edge_ns[i] = now_ns();
+        if (gpio_write(&cfg->out, i & 1) < 0)
+            break;
+        __atomic_store_n(&run->edges_written, i + 1, __ATOMIC_RELEASE);
+
+        deadline += run->interval_us * NSEC_PER_USEC;
+    }
+
+    __atomic_store_n(&run->writer_done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Latest edge written at or before the driver's timestamp for the event
+static long match_edge(const struct bench_run *run, int64_t timestamp_ns)
+{
+    long lo = 0, mid, found = -1;
+    long hi = __atomic_load_n(&run->edges_written, __ATOMIC_ACQUIRE) - 1;
+
+    while (lo <= hi) {
+        mid = lo + (hi - lo) / 2;
+        if (run->edge_ns[mid] <= timestamp_ns) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return found;
+}
+
+static int read_events(struct bench_run *run, int fd)
+{
+    struct gpio_button_event events[64];
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    bool have_seq = false;
+    uint32_t next_seq = 0;
+    int64_t t;
+    ssize_t n;
+    long edge;
+    int i, ret;
+
+    for (;;) {
+        ret = poll(&pfd, 1, IDLE_TIMEOUT_MS);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            ERROR_PRINT("poll() failed: %s", strerror(errno));
+            return -1;
+        }
+        if (ret == 0) {
+            if (__atomic_load_n(&run->writer_done, __ATOMIC_ACQUIRE))
+                return 0;
+            continue;
+        }
+
+        n = read(fd, events, sizeof(events));
+        t = now_ns();
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            ERROR_PRINT("read() failed: %s", strerror(errno));
+            return -1;
+        }
+
+        for (i = 0; i < n / (ssize_t)sizeof(events[0]); i++) {
+            if (have_seq && events[i].seq != next_seq)
+                run->ring_lost += events[i].seq - next_seq;
+            next_seq = events[i].seq + 1;
+            have_seq = true;
+
+            // Edges from before the run (or a stray press) are not ours
+            edge = match_edge(run, events[i].timestamp_ns);
+            if (edge < 0 || run->received >= run->cfg->edges)
+                continue;
+
+            run->e2e_ns[run->received] = t - run->edge_ns[edge];
+            run->irq_ns[run->received] = t - (int64_t)events[i].timestamp_ns;
+            run->received++;
+            run->last_read_ns = t;
+        }
+    }
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const int64_t *sorted, long n, double p)
+{
+    long idx = (long)(p / 100.0 * (n - 1) + 0.5);
+
+    return sorted[idx] / 1000.0;
+}
+
+static void print_latency(const char *name, int64_t *ns, long n)
+{
+    if (n == 0) {
+        printf("  %-14s no events\n", name);
+        return;
+    }
+
+    qsort(ns, n, sizeof(ns[0]), cmp_int64);
+    printf("  %-14s p50 %9.1f  p99 %9.1f  p99.9 %9.1f  max %9.1f us\n", name,
+           percentile_us(ns, n, 50), percentile_us(ns, n, 99),
+           percentile_us(ns, n, 99.9), ns[n - 1] / 1000.0);
+}
+
+// One pass at a fixed interval, returns the number of events lost or -1
+static long bench_run_once(struct bench_config *cfg, long interval_us, bool report)
+{
+    struct bench_run run = {
+        .cfg = cfg,
+        .interval_us = interval_us,
+    };
+    pthread_t writer;
+    int64_t start;
+    long lost = -1;
+    int fd;
+
+    run.edge_ns = calloc(cfg->edges, sizeof(int64_t));
+    run.e2e_ns = calloc(cfg->edges, sizeof(int64_t));
+    run.irq_ns = calloc(cfg->edges, sizeof(int64_t));
+    if (!run.edge_ns || !run.e2e_ns || !run.irq_ns) {
+        ERROR_PRINT("Out of memory for %ld edges", cfg->edges);
+        goto out;
+    }
+
+    // Opened first so the reader cursor starts before the first edge
+    fd = open(cfg->device, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+        ERROR_PRINT("Failed to open %s: %s", cfg->device, strerror(errno));
+        goto out;
+    }
+
+    start = now_ns();
+    if (pthread_create(&writer, NULL, writer_thread, &run) != 0) {
+        ERROR_PRINT("pthread_create() failed");
+        close(fd);
+        goto out;
+    }
+
+    read_events(&run, fd);
+    pthread_join(writer, NULL);
+    close(fd);
+
+    // Leave the input released for the next pass
+    gpio_write(&cfg->out, 1);
+
+    lost = run.edges_written - run.received;
+    if (report) {
+        printf("interval %ld us (+/- %ld), %ld edges written, %ld events received\n",
+               interval_us, cfg->jitter_us, run.edges_written, run.received);
+        printf("  lost %ld (ring overwrites %ld), %.1f events/s\n", lost, run.ring_lost,
+               run.received ? run.received * (double)NSEC_PER_SEC /
+                              (run.last_read_ns - start) : 0.0);
+        print_latency("write->read", run.e2e_ns, run.received);
+        print_latency("irq->read", run.irq_ns, run.received);
+    }
+
+out:
+    free(run.edge_ns);
+    free(run.e2e_ns);
+    free(run.irq_ns);
+    return lost;
+}
+
+static void print_usage(const char *prog_name)
+{
+    fprintf(stderr, "Usage: %s [-o pin] [-d device] [-n edges] [-i interval_us] [-j jitter_us] [-s] [-r prio]\n\n",
+            prog_name);
+    fprintf(stderr, "  -o  Output GPIO wired to the button input (default %d)\n",
+            DEFAULT_OUTPUT_PIN);
+    fprintf(stderr, "  -d  Button device (default %s)\n", GPIO_BUTTON_DEVICE);
+    fprintf(stderr, "  -n  Edges per run (default %d)\n", DEFAULT_EDGES);
+    fprintf(stderr, "  -i  Interval between edges in microseconds (default %d)\n",
+            DEFAULT_INTERVAL_US);
+    fprintf(stderr, "  -j  Uniform jitter added to each edge in microseconds\n");
+    fprintf(stderr, "  -s  Sweep: halve the interval until events are lost and\n"
+                    "      report the fastest loss-free rate\n");
+    fprintf(stderr, "  -r  Run SCHED_FIFO at this priority, with memory locked\n");
+}
+
+static int parse_long(const char *arg, long min, long max, long *val)
+{
+    char *end;
+
+    errno = 0;
+    *val = strtol(arg, &end, 0);
+    if (errno || end == arg || *end != '\0' || *val < min || *val > max)
+        return -1;
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_config cfg = {
+        .device = GPIO_BUTTON_DEVICE,
+        .edges = DEFAULT_EDGES,
+        .interval_us = DEFAULT_INTERVAL_US,
+    };
+    struct sched_param param;
+    unsigned int pin = DEFAULT_OUTPUT_PIN;
+    bool sweep = false;
+    long prio = 0, val, interval, best = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "o:d:n:i:j:sr:h")) >= 0) {
+        switch (opt) {
+        case 'o':
+            if (parse_long(optarg, 0, 1023, &val) < 0)
+                goto usage;
+            pin = val;
+            break;
+        case 'd':
+            cfg.device = optarg;
+            break;
+        case 'n':
+            if (parse_long(optarg, 1, 10000000, &cfg.edges) < 0)
+                goto usage;
+            break;
+        case 'i':
+            if (parse_long(optarg, 1, 10000000, &cfg.interval_us) < 0)
+                goto usage;
+            break;
+        case 'j':
+            if (parse_long(optarg, 0, 1000000, &cfg.jitter_us) < 0)
+                goto usage;
+            break;
+        case 's':
+            sweep = true;
+            break;
+        case 'r':
+            if (parse_long(optarg, sched_get_priority_min(SCHED_FIFO),
+                           sched_get_priority_max(SCHED_FIFO), &prio) < 0)
+                goto usage;
+            break;
+        case 'h':
+        default:
+            goto usage;
+        }
+    }
+
+    if (cfg.jitter_us >= cfg.interval_us) {
+        fprintf(stderr, "Jitter must be smaller than the interval\n");
+        return EXIT_FAILURE;
+    }
+
+    // Both threads inherit the policy, run stress-ng beside it for load
+    if (prio) {
+        param.sched_priority = prio;
+        if (sched_setscheduler(0, SCHED_FIFO, &param) < 0 ||
+            mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+            ERROR_PRINT("Failed to go real-time: %s", strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Start released: the button input is active-low
+    if (gpio_open(&cfg.out, &pin, 1, 1) < 0)
+        return EXIT_FAILURE;
+
+    if (!sweep) {
+        bench_run_once(&cfg, cfg.interval_us, true);
+    } else {
+        for (interval = cfg.interval_us; interval > cfg.jitter_us; interval /= 2) {
+            if (bench_run_once(&cfg, interval, true) != 0)
+                break;
+            best = interval;
+        }
+        if (best)
+            printf("max sustained rate: %.1f events/s (interval %ld us)\n",
+                   1e6 / best, best);
+        else
+            printf("events lost at the starting interval, no sustained rate\n");
+    }
+
+    gpio_close(&cfg.out);
+    return EXIT_SUCCESS;
+
+usage:
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+}
@@ -7,6 +7,7 @@
  * January 22, 2025
  *-----------------------------------------------------------------------------
 */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <syslog.h>
@@ -14,108 +15,997 @@
 #include <pthread.h>
 #include <stdbool.h>
 #include <signal.h>
-#include <gpiod.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
-#define DEBUG_PRINT(fmt, ...) \
-    fprintf(stderr, "%s:%d: " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__)
-#define ERROR_PRINT(fmt, ...) \
-    fprintf(stderr, "%s:%d: " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+#include "gpio_output.h"
+#include "pwm_output.h"
+#include "edge_log.h"
 
 #define GPIO_OUTPUT_PIN 18
 
-static bool stop_flag = false;
+#define NSEC_PER_SEC  1000000000L
+#define NSEC_PER_USEC 1000L
 
-static int gpio_write(int pin, int value)
+#define DEFAULT_PERIOD_US 2000000L  // 1 s high, 1 s low
+#define DEFAULT_DUTY      50        // percent
+
+// Brightness mode: GPIO 18 is PWM0 channel 0 on the RPi 4
+#define PWM_CHIP        0
+#define PWM_CHANNEL     0
+#define PWM_PERIOD_NS   1000000     // 1 kHz, well above visible flicker
+
+#define MAX_SUMMARY_SEC 3600
+
+// Control socket (-c)
+#define CONTROL_LINE_MAX    4096
+#define CONTROL_POLL_NS     50000           // first wait for an update to apply,
+#define CONTROL_POLL_MAX_NS 10000000        // doubled up to this for long frames
+
+#define BLINKY_STACK_SIZE    (256 * 1024)
+#define PREFAULT_STACK_SIZE  (64 * 1024)
+
+// Optional real-time settings for the blinky thread
+struct rt_options {
+    int priority;       // SCHED_FIFO priority, 0 leaves SCHED_OTHER
+    int cpu;            // CPU to pin to, -1 for no affinity
+    bool lock_memory;   // mlockall() and pre-fault the thread stack
+};
+
+// One pattern step: drive mask on the output lines for duration_ns
+struct frame {
+    uint64_t mask;
+    int64_t duration_ns;
+};
+
+/*
+ * Compiled pattern. The frames live in one contiguous array so playback is
+ * a table walk with no parsing or allocation.
+ */
+struct pattern {
+    struct frame *frames;
+    size_t num_frames;
+    int64_t cycle_ns;           // sum of all frame durations
+};
+
+/*
+ * A new schedule handed from the control thread to the blinky thread. The
+ * blinky thread swaps it in at a frame boundary, leaves the old pattern
+ * here and sets done; the control thread then frees it, so the blink path
+ * never calls free().
+ */
+struct blink_update {
+    struct pattern pattern;
+    unsigned int pins[MAX_LINES];
+    unsigned int num_lines;     // 0 keeps the current lines
+    int64_t start_ns;           // deadline its first frame was played at
+    int done;
+    int error;
+};
+
+// What the control thread last asked for, owned by the control thread
+struct control_state {
+    long period_us;
+    int duty;
+    char *spec;                 // pattern mode, NULL while -p/-d drive it
+    unsigned int pins[MAX_LINES];
+    unsigned int num_lines;
+};
+
+// Blink schedule and the statistics gathered while running it
+struct blink_config {
+    struct gpio_output *out;
+    struct pwm_output *pwm;     // brightness mode, replaces out when set
+    struct rt_options rt;
+    struct pattern pattern;
+    unsigned long overruns;     // also read by the summary thread
+    int64_t max_late_ns;
+    struct edge_log *log;       // -S, NULL when no summaries are wanted
+    long summary_sec;
+    // -c control socket
+    struct blink_update *pending;
+    int control_fd;
+    int client_fd;              // connection being served, -1 for none
+    struct control_state control;
+};
+
+// Set by the signal handler and read by every thread
+static _Atomic bool stop_flag = false;
+
+static int parse_long(const char *str, long min, long max, long *val);
+
+// Wakes the summary thread early on exit so the last interval is flushed
+static pthread_mutex_t summary_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t summary_cond;
+
+/*
+ * Parse a comma separated list of GPIO offsets, e.g. "18,23,24". The order
+ * given is the bit order used for masks.
+ */
+static int parse_pins(const char *str, unsigned int *pins, unsigned int *num_lines)
 {
-    struct gpiod_chip *chip;
-    struct gpiod_line *line;
-    int ret;
+    char *copy, *tok, *save = NULL, *end;
+    unsigned int i, n = 0;
+    unsigned long pin;
+    int ret = 0;
 
-    chip = gpiod_chip_open("/dev/gpiochip0");
-    if (!chip) {
-        syslog(LOG_ERR, "Failed to open GPIO chip");
-        ERROR_PRINT("gpiod_chip_open() failed");
-        fprintf(stderr, "gpiod_chip_open() failed, code: %d, message: %s\n",
-            errno, strerror(errno));
+    copy = strdup(str);
+    if (!copy)
         return -1;
+
+    for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        errno = 0;
+        pin = strtoul(tok, &end, 0);
+        if (errno || end == tok || *end != '\0' || pin > UINT_MAX || n == MAX_LINES) {
+            ret = -1;
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (pins[i] == pin)
+                ret = -1;
+        }
+        if (ret)
+            break;
+
+        pins[n++] = pin;
     }
 
-    // Get the GPIO line (pin) based on the pin number
-    line = gpiod_chip_get_line(chip, pin);
-    if (!line) {
-        syslog(LOG_ERR, "Failed to get GPIO line");
-        ERROR_PRINT("gpiod_chip_get_line() failed");
-        fprintf(stderr, "gpiod_chip_get_line() failed, code: %d, message: %s\n",
-            errno, strerror(errno));
-        gpiod_chip_close(chip);
+    free(copy);
+    if (ret || n == 0)
         return -1;
+
+    *num_lines = n;
+    return 0;
+}
+
+/*
+ * Append a frame, growing the table geometrically. Consecutive frames with
+ * the same mask are merged so playback never issues a redundant write.
+ */
+static int pattern_add(struct pattern *pat, size_t *capacity, uint64_t mask,
+                       int64_t duration_ns)
+{
+    struct frame *frames;
+
+    if (pat->num_frames && pat->frames[pat->num_frames - 1].mask == mask) {
+        pat->frames[pat->num_frames - 1].duration_ns += duration_ns;
+        pat->cycle_ns += duration_ns;
+        return 0;
     }
 
-    // Request the line as output
-    ret = gpiod_line_request_output(line, "blinky", value);
-    if (ret < 0) {
-        syslog(LOG_ERR, "Failed to request GPIO line for output");
-        ERROR_PRINT("gpiod_line_request_output() failed");
-        fprintf(stderr, "gpiod_line_request_output() failed, code: %d, message: %s\n",
-            errno, strerror(errno));
-        gpiod_chip_close(chip);
+    if (pat->num_frames == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 16;
+        frames = realloc(pat->frames, *capacity * sizeof(*frames));
+        if (!frames)
+            return -1;
+        pat->frames = frames;
+    }
+
+    pat->frames[pat->num_frames].mask = mask;
+    pat->frames[pat->num_frames].duration_ns = duration_ns;
+    pat->num_frames++;
+    pat->cycle_ns += duration_ns;
+    return 0;
+}
+
+static void pattern_free(struct pattern *pat)
+{
+    free(pat->frames);
+    pat->frames = NULL;
+    pat->num_frames = 0;
+    pat->cycle_ns = 0;
+}
+
+// Trim the table to its final size once all frames are known
+static int pattern_finish(struct pattern *pat)
+{
+    struct frame *frames;
+
+    if (pat->num_frames == 0 || pat->cycle_ns <= 0)
         return -1;
+
+    if (pat->num_frames > 1 &&
+        pat->frames[0].mask == pat->frames[pat->num_frames - 1].mask) {
+        // The cycle wraps onto the same mask, fold the last frame into the first
+        pat->frames[0].duration_ns += pat->frames[pat->num_frames - 1].duration_ns;
+        pat->num_frames--;
     }
 
-    // Set the GPIO line value
-    ret = gpiod_line_set_value(line, value);
-    if (ret < 0) {
-        syslog(LOG_ERR, "Failed to write to GPIO line");
-        ERROR_PRINT("gpiod_line_set_value() failed");
-        fprintf(stderr, "gpiod_line_set_value() failed, code: %d, message: %s\n",
-            errno, strerror(errno));
-        gpiod_chip_close(chip);
+    frames = realloc(pat->frames, pat->num_frames * sizeof(*frames));
+    if (frames)
+        pat->frames = frames;
+
+    return 0;
+}
+
+/*
+ * Compile a pattern spec into a frame table. The spec is a list of
+ * mask:duration_us frames separated by commas or whitespace, '#' starts a
+ * comment that runs to the end of the line, e.g. "0x1:500000,0x2:500000".
+ * Masks may only use bits of valid_mask.
+ */
+static int pattern_compile(struct pattern *pat, const char *spec, uint64_t valid_mask)
+{
+    const char *p = spec;
+    size_t capacity = 0;
+    unsigned long long mask;
+    long long duration_us;
+    char *end;
+
+    memset(pat, 0, sizeof(*pat));
+
+    while (*p) {
+        if (*p == '#') {
+            while (*p && *p != '\n')
+                p++;
+            continue;
+        }
+        if (*p == ',' || *p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+            p++;
+            continue;
+        }
+
+        errno = 0;
+        mask = strtoull(p, &end, 0);
+        if (errno || end == p || *end != ':' || (mask & ~valid_mask))
+            goto err;
+
+        p = end + 1;
+        duration_us = strtoll(p, &end, 0);
+        if (errno || end == p || duration_us <= 0 ||
+            duration_us > INT64_MAX / NSEC_PER_USEC)
+            goto err;
+        p = end;
+
+        if (pattern_add(pat, &capacity, mask, duration_us * NSEC_PER_USEC) < 0)
+            goto err;
+    }
+
+    if (pattern_finish(pat) < 0)
+        goto err;
+
+    return 0;
+
+err:
+    pattern_free(pat);
+    return -1;
+}
+
+// Plain blinking: on_mask for duty percent of the period, then all off
+static int pattern_from_duty(struct pattern *pat, long period_us, int duty,
+                             uint64_t on_mask)
+{
+    int64_t period_ns = (int64_t)period_us * NSEC_PER_USEC;
+    int64_t on_ns = period_ns * duty / 100;
+    size_t capacity = 0;
+
+    memset(pat, 0, sizeof(*pat));
+
+    if ((on_ns > 0 && pattern_add(pat, &capacity, on_mask, on_ns) < 0) ||
+        (on_ns < period_ns && pattern_add(pat, &capacity, 0, period_ns - on_ns) < 0) ||
+        pattern_finish(pat) < 0) {
+        pattern_free(pat);
         return -1;
     }
 
-    gpiod_chip_close(chip);
     return 0;
 }
 
+// Read a whole pattern file into a NUL terminated buffer
+static char *read_file(const char *path)
+{
+    FILE *fp;
+    char *buf = NULL, *tmp;
+    size_t len = 0, capacity = 0, n;
+
+    fp = fopen(path, "r");
+    if (!fp)
+        return NULL;
+
+    do {
+        if (capacity - len < 4096) {
+            capacity += 4096;
+            tmp = realloc(buf, capacity + 1);
+            if (!tmp) {
+                free(buf);
+                fclose(fp);
+                return NULL;
+            }
+            buf = tmp;
+        }
+        n = fread(buf + len, 1, capacity - len, fp);
+        len += n;
+    } while (n > 0);
+
+    if (ferror(fp)) {
+        free(buf);
+        fclose(fp);
+        return NULL;
+    }
+
+    fclose(fp);
+    buf[len] = '\0';
+    return buf;
+}
+
+static void timespec_add_ns(struct timespec *ts, int64_t ns)
+{
+    ts->tv_sec += ns / NSEC_PER_SEC;
+    ts->tv_nsec += ns % NSEC_PER_SEC;
+    if (ts->tv_nsec >= NSEC_PER_SEC) {
+        ts->tv_nsec -= NSEC_PER_SEC;
+        ts->tv_sec++;
+    }
+}
+
+static int64_t timespec_diff_ns(const struct timespec *a, const struct timespec *b)
+{
+    return (int64_t)(a->tv_sec - b->tv_sec) * NSEC_PER_SEC +
+           (a->tv_nsec - b->tv_nsec);
+}
+
+/*
+ * Sleep until the absolute CLOCK_MONOTONIC deadline. If the deadline has
+ * already passed the overrun is recorded and, when more than a whole pattern
+ * cycle was lost, the deadline is moved forward by whole cycles so the
+ * schedule keeps its original phase instead of trying to catch up.
+ */
+static void wait_until(struct blink_config *cfg, struct timespec *deadline)
+{
+    struct timespec now, timeout;
+    sigset_t stop_sigs;
+    int64_t late, left;
+    int64_t cycle_ns = cfg->pattern.cycle_ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    late = timespec_diff_ns(&now, deadline);
+    if (late >= 0) {
+        // Reported by the summary thread, never logged from here
+        __atomic_store_n(&cfg->overruns, cfg->overruns + 1, __ATOMIC_RELAXED);
+        if (late > cfg->max_late_ns)
+            cfg->max_late_ns = late;
+
+        if (late >= cycle_ns)
+            timespec_add_ns(deadline, (late / cycle_ns + 1) * cycle_ns);
+        return;
+    }
+
+    /*
+     * main() sends SIGUSR1 on stop, updates wait for the deadline. The
+     * signal is blocked in every thread, so one sent before the sleep starts
+     * stays pending and sigtimedwait() returns at once instead of missing it.
+     */
+    sigemptyset(&stop_sigs);
+    sigaddset(&stop_sigs, SIGUSR1);
+    while (!stop_flag) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left = timespec_diff_ns(deadline, &now);
+        if (left <= 0)
+            break;
+        timeout.tv_sec = left / NSEC_PER_SEC;
+        timeout.tv_nsec = left % NSEC_PER_SEC;
+        if (sigtimedwait(&stop_sigs, NULL, &timeout) < 0 && errno == EAGAIN)
+            break;
+    }
+}
+
+// Frame masks go to the GPIO lines, or in brightness mode bit 0 to the PWM
+static int output_write(struct blink_config *cfg, uint64_t mask)
+{
+    if (cfg->pwm)
+        return pwm_write(cfg->pwm, mask & 1);
+
+    return gpio_write(cfg->out, mask);
+}
+
+static uint64_t line_set_mask(unsigned int num_lines)
+{
+    return num_lines == MAX_LINES ? ~0ULL : (1ULL << num_lines) - 1;
+}
+
+/*
+ * Take a pending update at the frame boundary deadline, where its first
+ * frame is played, so the deadline chain and the phase of the edges carry
+ * on. A new line set means releasing the old lines first, since the sets
+ * may overlap; if the new ones cannot be requested blinky stops.
+ */
+static bool apply_update(struct blink_config *cfg, const struct timespec *deadline)
+{
+    struct blink_update *u = __atomic_exchange_n(&cfg->pending, NULL, __ATOMIC_ACQUIRE);
+    struct pattern old;
+
+    if (!u)
+        return false;
+
+    if (u->num_lines) {
+        gpio_close(cfg->out);
+        if (gpio_open(cfg->out, u->pins, u->num_lines, 0) < 0) {
+            syslog(LOG_ERR, "Failed to request the new lines, stopping");
+            u->error = -1;
+            stop_flag = true;
+        }
+    }
+
+    old = cfg->pattern;
+    cfg->pattern = u->pattern;
+    u->pattern = old;
+    u->start_ns = (int64_t)deadline->tv_sec * NSEC_PER_SEC + deadline->tv_nsec;
+    __atomic_store_n(&u->done, 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+// Touch the stack we are going to use so the loop never page faults on it
+static void prefault_stack(void)
+{
+    volatile unsigned char stack[PREFAULT_STACK_SIZE];
+
+    memset((unsigned char *)stack, 0, sizeof(stack));
+}
+
+// One record per edge for the summary thread, a clock read and a copy
+static void log_edge(struct blink_config *cfg, const struct timespec *deadline, uint64_t mask)
+{
+    struct timespec now;
+    struct edge_record rec;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    rec.time_ns = (int64_t)deadline->tv_sec * NSEC_PER_SEC + deadline->tv_nsec;
+    rec.late_ns = timespec_diff_ns(&now, deadline);
+    rec.mask = mask;
+    edge_log_put(cfg->log, &rec);
+}
+
 // Blinky thread function
 static void *blinky_thread(void *arg)
 {
+    struct blink_config *cfg = arg;
+    const struct frame *frames = cfg->pattern.frames;
+    size_t num_frames = cfg->pattern.num_frames;
+    size_t i = 0;
+    struct timespec next;
+
+    if (cfg->rt.lock_memory)
+        prefault_stack();
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
     while (!stop_flag) {
-        syslog(LOG_DEBUG, "Setting gpio %d high", GPIO_OUTPUT_PIN);
-        gpio_write(GPIO_OUTPUT_PIN, 1);  // GPIO 18
-        sleep(1);
+        output_write(cfg, frames[i].mask);
+        if (cfg->log)
+            log_edge(cfg, &next, frames[i].mask);
+        timespec_add_ns(&next, frames[i].duration_ns);
+        wait_until(cfg, &next);
 
-        syslog(LOG_DEBUG, "Setting gpio %d low", GPIO_OUTPUT_PIN);
-        gpio_write(GPIO_OUTPUT_PIN, 0);
-        sleep(1);
+        // A new schedule starts with its first frame at this deadline
+        if (__atomic_load_n(&cfg->pending, __ATOMIC_RELAXED) && apply_update(cfg, &next)) {
+            frames = cfg->pattern.frames;
+            num_frames = cfg->pattern.num_frames;
+            i = 0;
+            continue;
+        }
+
+        if (++i == num_frames)
+            i = 0;
     }
 
+    syslog(LOG_INFO, "Blink schedule stopped, %lu overruns, max lateness %lld ns",
+           cfg->overruns, (long long)cfg->max_late_ns);
+
     return NULL;
 }
 
+/*
+ * Every summary_sec drain the edge log and write one summary line. Edge
+ * records are only formatted at LOG_DEBUG (-v), syslog() drops them before
+ * formatting otherwise. Runs SCHED_IDLE: if it is starved the ring
+ * overwrites and the loss shows up in the next summary.
+ */
+static void *summary_thread(void *arg)
+{
+    struct blink_config *cfg = arg;
+    struct sched_param param = { .sched_priority = 0 };
+    struct edge_record rec;
+    struct timespec deadline;
+    unsigned long edges, overruns, last_overruns = 0, last_lost = 0;
+    int64_t max_late;
+
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    pthread_mutex_lock(&summary_lock);
+
+    while (!stop_flag) {
+        deadline.tv_sec += cfg->summary_sec;
+        while (!stop_flag &&
+               pthread_cond_timedwait(&summary_cond, &summary_lock, &deadline) != ETIMEDOUT)
+            ;
+
+        edges = 0;
+        max_late = 0;
+        while (edge_log_get(cfg->log, &rec)) {
+            edges++;
+            if (rec.late_ns > max_late)
+                max_late = rec.late_ns;
+            syslog(LOG_DEBUG, "Edge at %lld ns: lines 0x%llx, %lld ns late",
+                   (long long)rec.time_ns, (unsigned long long)rec.mask,
+                   (long long)rec.late_ns);
+        }
+
+        overruns = __atomic_load_n(&cfg->overruns, __ATOMIC_RELAXED);
+        syslog(LOG_INFO, "%lu edges, %lu overruns, max lateness %lld ns, %lu records lost",
+               edges, overruns - last_overruns, (long long)max_late,
+               cfg->log->lost - last_lost);
+        last_overruns = overruns;
+        last_lost = cfg->log->lost;
+    }
+
+    pthread_mutex_unlock(&summary_lock);
+    return NULL;
+}
+
+// Condition variable on CLOCK_MONOTONIC, like the blink schedule
+static int init_summary_cond(void)
+{
+    pthread_condattr_t attr;
+    int ret;
+
+    ret = pthread_condattr_init(&attr);
+    if (ret)
+        return ret;
+
+    ret = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (!ret)
+        ret = pthread_cond_init(&summary_cond, &attr);
+
+    pthread_condattr_destroy(&attr);
+    return ret;
+}
+
+/*
+ * Hand an update to the blinky thread and wait until it plays it, at the
+ * end of the current frame. Returns the time from here to its first frame,
+ * or -1 if the update was not applied.
+ */
+static int64_t publish_update(struct blink_config *cfg, struct blink_update *u)
+{
+    struct timespec start;
+    struct timespec pause = { .tv_sec = 0, .tv_nsec = CONTROL_POLL_NS };
+    int64_t start_ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    __atomic_store_n(&cfg->pending, u, __ATOMIC_RELEASE);
+
+    while (!__atomic_load_n(&u->done, __ATOMIC_ACQUIRE)) {
+        // Still there means it was never taken, otherwise done is close
+        if (stop_flag && __atomic_exchange_n(&cfg->pending, NULL, __ATOMIC_ACQUIRE) == u) {
+            u->error = -1;
+            break;
+        }
+        nanosleep(&pause, NULL);
+        pause.tv_nsec = pause.tv_nsec * 2 > CONTROL_POLL_MAX_NS ? CONTROL_POLL_MAX_NS
+                                                                : pause.tv_nsec * 2;
+    }
+
+    if (u->error)
+        return -1;
+
+    start_ns = u->start_ns - ((int64_t)start.tv_sec * NSEC_PER_SEC + start.tv_nsec);
+    return start_ns > 0 ? start_ns : 0;
+}
+
+// Compile the schedule the control state describes into an update
+static int control_build(const struct control_state *st, struct blink_update *u)
+{
+    uint64_t mask = line_set_mask(st->num_lines);
+
+    if (st->spec)
+        return pattern_compile(&u->pattern, st->spec, mask);
+
+    return pattern_from_duty(&u->pattern, st->period_us, st->duty, mask);
+}
+
+// Text form of the control state for the status command
+static void control_status(struct blink_config *cfg, char *reply, size_t len)
+{
+    const struct control_state *st = &cfg->control;
+    int n = 0;
+    unsigned int i;
+
+    if (st->spec) {
+        n += snprintf(reply + n, len - n, "ok pattern %zu frames", cfg->pattern.num_frames);
+    } else {
+        n += snprintf(reply + n, len - n, "ok period %ld duty %d", st->period_us, st->duty);
+    }
+    for (i = 0; i < st->num_lines && n < (int)len; i++)
+        n += snprintf(reply + n, len - n, "%s%u", i ? "," : " lines ", st->pins[i]);
+    if (n < (int)len) {
+        snprintf(reply + n, len - n, " overruns %lu\n",
+                 __atomic_load_n(&cfg->overruns, __ATOMIC_RELAXED));
+    }
+}
+
+/*
+ * One control command, "period <us>", "duty <percent>", "pattern <spec>",
+ * "lines <list>" or "status". The reply is "ok ..." or "error ...". A
+ * change is only acknowledged once the blinky thread plays it.
+ */
+static void control_command(struct blink_config *cfg, char *line, char *reply, size_t len)
+{
+    struct control_state st = cfg->control;
+    struct blink_update *u;
+    char *arg;
+    int64_t latency;
+    long val;
+    bool new_lines = false;
+
+    line[strcspn(line, "\r\n")] = '\0';
+    arg = strchr(line, ' ');
+    if (arg)
+        *arg++ = '\0';
+
+    if (!strcmp(line, "status")) {
+        control_status(cfg, reply, len);
+        return;
+    }
+    if (!arg) {
+        snprintf(reply, len, "error unknown command\n");
+        return;
+    }
+
+    if (!strcmp(line, "period")) {
+        if (parse_long(arg, 1, LONG_MAX / NSEC_PER_USEC, &val) < 0)
+            goto err_arg;
+        st.period_us = val;
+        st.spec = NULL;
+    } else if (!strcmp(line, "duty")) {
+        if (parse_long(arg, 0, 100, &val) < 0)
+            goto err_arg;
+        st.duty = val;
+        st.spec = NULL;
+    } else if (!strcmp(line, "pattern")) {
+        st.spec = arg;
+    } else if (!strcmp(line, "lines")) {
+        if (cfg->pwm) {
+            snprintf(reply, len, "error no lines in brightness mode\n");
+            return;
+        }
+        if (parse_pins(arg, st.pins, &st.num_lines) < 0)
+            goto err_arg;
+        new_lines = true;
+    } else {
+        snprintf(reply, len, "error unknown command\n");
+        return;
+    }
+
+    u = calloc(1, sizeof(*u));
+    if (!u) {
+        snprintf(reply, len, "error out of memory\n");
+        return;
+    }
+    if (control_build(&st, u) < 0) {
+        free(u);
+        goto err_arg;
+    }
+    if (new_lines) {
+        memcpy(u->pins, st.pins, sizeof(u->pins));
+        u->num_lines = st.num_lines;
+    }
+
+    // Keep our own copy of a new spec, the line buffer is reused
+    if (st.spec && st.spec != cfg->control.spec) {
+        st.spec = strdup(st.spec);
+        if (!st.spec) {
+            pattern_free(&u->pattern);
+            free(u);
+            snprintf(reply, len, "error out of memory\n");
+            return;
+        }
+    }
+
+    latency = publish_update(cfg, u);
+    if (latency < 0) {
+        snprintf(reply, len, "error not applied\n");
+        if (st.spec != cfg->control.spec)
+            free(st.spec);
+        // Taken and failed: the blinky thread is done with it, else it was never seen
+        pattern_free(&u->pattern);
+        free(u);
+        return;
+    }
+
+    if (cfg->control.spec != st.spec)
+        free(cfg->control.spec);
+    cfg->control = st;
+    pattern_free(&u->pattern);
+    free(u);
+    snprintf(reply, len, "ok applied in %lld us\n", (long long)(latency / NSEC_PER_USEC));
+    return;
+
+err_arg:
+    snprintf(reply, len, "error invalid argument\n");
+}
+
+/*
+ * Serve the control socket, one connection at a time and one command per
+ * line. main() shuts the sockets down to stop it.
+ */
+static void *control_thread(void *arg)
+{
+    struct blink_config *cfg = arg;
+    char reply[256];
+    char *line;
+    FILE *fp;
+    int fd;
+
+    line = malloc(CONTROL_LINE_MAX);
+    if (!line)
+        return NULL;
+
+    while (!stop_flag) {
+        fd = accept4(cfg->control_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+
+        __atomic_store_n(&cfg->client_fd, fd, __ATOMIC_SEQ_CST);
+        fp = stop_flag ? NULL : fdopen(fd, "r");
+        if (!fp) {
+            __atomic_store_n(&cfg->client_fd, -1, __ATOMIC_SEQ_CST);
+            close(fd);
+            continue;
+        }
+
+        while (fgets(line, CONTROL_LINE_MAX, fp)) {
+            control_command(cfg, line, reply, sizeof(reply));
+            if (write(fd, reply, strlen(reply)) < 0)
+                break;
+        }
+
+        __atomic_store_n(&cfg->client_fd, -1, __ATOMIC_SEQ_CST);
+        fclose(fp);
+    }
+
+    free(line);
+    return NULL;
+}
+
+// Listening socket for -c, only the owner and group may connect
+static int control_open(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    mode_t mask;
+    int fd, ret;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR, "Control socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        syslog(LOG_ERR, "socket() failed: %s", strerror(errno));
+        return -1;
+    }
+
+    // A previous instance that was killed leaves its socket behind
+    unlink(path);
+    // Created 0660 rather than chmod()ed after bind(), so it is never open to others
+    mask = umask(0117);
+    ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (ret < 0 || listen(fd, 1) < 0) {
+        syslog(LOG_ERR, "Failed to set up control socket %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
 void signal_handler(int signal) {
     stop_flag = true;
     syslog(LOG_INFO, "Received signal %d - exiting", signal);
 }
 
+/*
+ * Build the blinky thread attributes from the real-time options. Explicit
+ * scheduling has to be requested, otherwise the new thread silently
+ * inherits SCHED_OTHER from main().
+ */
+static int init_thread_attr(pthread_attr_t *attr, const struct rt_options *rt)
+{
+    struct sched_param param = { .sched_priority = rt->priority };
+    cpu_set_t cpus;
+    int ret;
+
+    ret = pthread_attr_init(attr);
+    if (ret)
+        return ret;
+
+    ret = pthread_attr_setstacksize(attr, BLINKY_STACK_SIZE);
+    if (ret)
+        goto err;
+
+    if (rt->priority > 0) {
+        ret = pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+        if (!ret)
+            ret = pthread_attr_setschedpolicy(attr, SCHED_FIFO);
+        if (!ret)
+            ret = pthread_attr_setschedparam(attr, &param);
+        if (ret)
+            goto err;
+    }
+
+    if (rt->cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(rt->cpu, &cpus);
+        ret = pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+        if (ret)
+            goto err;
+    }
+
+    return 0;
+
+err:
+    pthread_attr_destroy(attr);
+    return ret;
+}
+
 void print_usage(const char *prog_name) {
-    fprintf(stderr, "Usage: %s\n\n", prog_name);
+    fprintf(stderr, "Usage: %s [-D] [-p period_us] [-d duty] [-s spec | -f file] [-l lines | -b brightness] [-r prio] [-a cpu] [-L] [-S sec] [-v | -q] [-c socket]\n\n",
+            prog_name);
     fprintf(stderr, "  -D  Do not daemonize\n");
+    fprintf(stderr, "  -p  Blink period in microseconds (default %ld)\n",
+            DEFAULT_PERIOD_US);
+    fprintf(stderr, "  -d  Duty cycle in percent, 0-100 (default %d)\n",
+            DEFAULT_DUTY);
+    fprintf(stderr, "  -s  Play a pattern of mask:duration_us frames, e.g. 0x1:500000,0x2:500000\n");
+    fprintf(stderr, "  -f  Play the pattern read from this file (same syntax as -s)\n");
+    fprintf(stderr, "  -l  Comma separated GPIO lines driven together (default %d)\n",
+            GPIO_OUTPUT_PIN);
+    fprintf(stderr, "  -b  Drive GPIO 18 as PWM%d at this brightness in percent while on\n"
+                    "      (replaces the GPIO lines, cannot be combined with -l)\n",
+            PWM_CHANNEL);
+    fprintf(stderr, "  -r  Run the blink thread SCHED_FIFO at this priority\n");
+    fprintf(stderr, "  -a  Pin the blink thread to this CPU\n");
+    fprintf(stderr, "  -L  Lock memory (mlockall) and pre-fault the thread stack\n");
+    fprintf(stderr, "  -S  Log a summary of edges, overruns and lateness every sec seconds\n");
+    fprintf(stderr, "  -v  Verbose: also log every edge record with the summaries\n");
+    fprintf(stderr, "  -q  Quiet: warnings and errors only, twice for errors only\n");
+    fprintf(stderr, "  -c  Accept period/duty/pattern/lines/status commands on this Unix socket\n");
     fprintf(stderr, "  -h  Display usage information (this message)\n\n");
 }
 
+static int parse_long(const char *str, long min, long max, long *val)
+{
+    char *end;
+
+    errno = 0;
+    *val = strtol(str, &end, 0);
+    if (errno || end == str || *end != '\0' || *val < min || *val > max)
+        return -1;
+
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     bool daemonize = true;
     int opt;
     int retval = EXIT_SUCCESS;
+    struct gpio_output led = { .chip = NULL };
+    struct pwm_output pwm = { .duty_fd = -1 };
+    long brightness = 0;
+    unsigned int pins[MAX_LINES] = { GPIO_OUTPUT_PIN };
+    unsigned int num_lines = 1;
+    bool lines_given = false;
+    struct blink_config cfg = {
+        .out = &led,
+        .rt = { .priority = 0, .cpu = -1, .lock_memory = false },
+        .control_fd = -1,
+        .client_fd = -1,
+    };
+    long period_us = DEFAULT_PERIOD_US;
+    int duty = DEFAULT_DUTY;
+    const char *pattern_spec = NULL;
+    const char *pattern_file = NULL;
+    char *file_spec = NULL;
+    uint64_t all_mask;
+    pthread_attr_t attr;
+    int fd;
+    pthread_t summary;
+    pthread_t control;
+    const char *control_path = NULL;
+    sigset_t stop_sigs;
+    int log_level = LOG_INFO;
+    long val;
+    int ret;
 
-    while ((opt = getopt (argc, argv, "Dh")) >= 0) {
+    while ((opt = getopt (argc, argv, "Dp:d:s:f:l:b:r:a:LS:vqc:h")) >= 0) {
         switch (opt) {
         case 'D':
             daemonize = false;
             break;
+        case 'p':
+            if (parse_long(optarg, 1, LONG_MAX / NSEC_PER_USEC, &val) < 0) {
+                fprintf(stderr, "Invalid period: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            period_us = val;
+            break;
+        case 'd':
+            if (parse_long(optarg, 0, 100, &val) < 0) {
+                fprintf(stderr, "Invalid duty cycle: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            duty = val;
+            break;
+        case 's':
+            pattern_spec = optarg;
+            break;
+        case 'f':
+            pattern_file = optarg;
+            break;
+        case 'l':
+            if (parse_pins(optarg, pins, &num_lines) < 0) {
+                fprintf(stderr, "Invalid line list: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            lines_given = true;
+            break;
+        case 'b':
+            if (parse_long(optarg, 0, 100, &brightness) < 0) {
+                fprintf(stderr, "Invalid brightness: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            cfg.pwm = &pwm;
+            break;
+        case 'r':
+            if (parse_long(optarg, sched_get_priority_min(SCHED_FIFO),
+                           sched_get_priority_max(SCHED_FIFO), &val) < 0) {
+                fprintf(stderr, "Invalid priority: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            cfg.rt.priority = val;
+            break;
+        case 'a':
+            if (parse_long(optarg, 0, CPU_SETSIZE - 1, &val) < 0) {
+                fprintf(stderr, "Invalid CPU: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            cfg.rt.cpu = val;
+            break;
+        case 'L':
+            cfg.rt.lock_memory = true;
+            break;
+        case 'S':
+            if (parse_long(optarg, 1, MAX_SUMMARY_SEC, &val) < 0) {
+                fprintf(stderr, "Invalid summary interval: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            cfg.summary_sec = val;
+            break;
+        case 'v':
+            log_level = LOG_DEBUG;
+            break;
+        case 'q':
+            log_level = log_level > LOG_WARNING ? LOG_WARNING : LOG_ERR;
+            break;
+        case 'c':
+            control_path = optarg;
+            break;
         case 'h':
             print_usage(argv[0]);
             return EXIT_SUCCESS;
@@ -125,17 +1015,85 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    // The PWM is a single channel on GPIO 18, patterns may only use bit 0
+    if (cfg.pwm && lines_given) {
+        fprintf(stderr, "-l cannot be combined with -b\n");
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Compile the pattern before anything is opened, playback never parses
+    all_mask = line_set_mask(num_lines);
+    if (pattern_file) {
+        file_spec = read_file(pattern_file);
+        if (!file_spec) {
+            fprintf(stderr, "Failed to read pattern file %s: %s\n",
+                    pattern_file, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        pattern_spec = file_spec;
+    }
+
+    if (pattern_spec) {
+        ret = pattern_compile(&cfg.pattern, pattern_spec, all_mask);
+    } else {
+        ret = pattern_from_duty(&cfg.pattern, period_us, duty, all_mask);
+    }
+    if (ret < 0) {
+        free(file_spec);
+        fprintf(stderr, "Invalid pattern\n");
+        return EXIT_FAILURE;
+    }
+
+    // The control thread rebuilds schedules from what the command line set
+    cfg.control.period_us = period_us;
+    cfg.control.duty = duty;
+    memcpy(cfg.control.pins, pins, sizeof(pins));
+    cfg.control.num_lines = num_lines;
+    if (pattern_spec) {
+        cfg.control.spec = file_spec ? file_spec : strdup(pattern_spec);
+        file_spec = NULL;
+        if (!cfg.control.spec) {
+            pattern_free(&cfg.pattern);
+            return EXIT_FAILURE;
+        }
+    }
+    free(file_spec);
+
     // Setup signal handler
     signal(SIGINT,  signal_handler);
     signal(SIGTERM, signal_handler);
     signal(SIGSEGV, signal_handler);
+    // Blocked before any thread starts, the blinky thread waits for it
+    sigemptyset(&stop_sigs);
+    sigaddset(&stop_sigs, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &stop_sigs, NULL);
 
     // Set logging level for messages submitted to syslog
-    setlogmask(LOG_UPTO(LOG_DEBUG));
+    setlogmask(LOG_UPTO(log_level));
     openlog(NULL, LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
 
     syslog(LOG_INFO, "Started");
 
+    // Allocated before mlockall() so the ring is locked with everything else
+    if (cfg.summary_sec) {
+        cfg.log = calloc(1, sizeof(*cfg.log));
+        if (!cfg.log) {
+            syslog(LOG_ERR, "Failed to allocate the edge log");
+            goto err;
+        }
+    }
+
+    // Open the PWM or the chip and request the output lines once, up front
+    if (cfg.pwm) {
+        if (pwm_open(&pwm, PWM_CHIP, PWM_CHANNEL, PWM_PERIOD_NS,
+                     (uint64_t)PWM_PERIOD_NS * brightness / 100) < 0) {
+            goto err;
+        }
+    } else if (gpio_open(&led, pins, num_lines, 0) < 0) {
+        goto err;
+    }
+
     // Run in the background if needed
     if (daemonize) {
         if (daemon(0, 0) < 0) {
@@ -144,22 +1102,89 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    // Memory locks are not inherited across fork(), so lock after daemon()
+    if (cfg.rt.lock_memory) {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+            syslog(LOG_ERR, "mlockall() failed: %s", strerror(errno));
+            goto err;
+        }
+    }
+
+    ret = init_thread_attr(&attr, &cfg.rt);
+    if (ret) {
+        syslog(LOG_ERR, "Failed to set up thread attributes: %s", strerror(ret));
+        goto err;
+    }
+
     // Spawn a thread to blink the LEDs
     pthread_t thread1;
-    if (pthread_create(&thread1, NULL, blinky_thread, NULL) != 0) {
-        syslog(LOG_ERR, "Failed to create blinky thread");
+    ret = pthread_create(&thread1, &attr, blinky_thread, &cfg);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        syslog(LOG_ERR, "Failed to create blinky thread: %s", strerror(ret));
         goto err;
     }
 
+    if (cfg.log) {
+        ret = init_summary_cond();
+        if (!ret)
+            ret = pthread_create(&summary, NULL, summary_thread, &cfg);
+        if (ret) {
+            // The blink schedule does not depend on it, run without summaries
+            syslog(LOG_ERR, "Failed to create summary thread: %s", strerror(ret));
+            cfg.summary_sec = 0;
+        }
+    }
+
+    if (control_path) {
+        cfg.control_fd = control_open(control_path);
+        ret = cfg.control_fd < 0 ? -1 : pthread_create(&control, NULL, control_thread, &cfg);
+        if (ret) {
+            // Keep blinking the current schedule without live control
+            syslog(LOG_ERR, "Control socket unavailable, running without it");
+            if (cfg.control_fd >= 0) {
+                close(cfg.control_fd);
+                unlink(control_path);
+                cfg.control_fd = -1;
+            }
+            control_path = NULL;
+        }
+    }
+
     while (!stop_flag) {
         sleep(1);
     }
 
     syslog(LOG_INFO, "Main thread exiting");
 
+    // Wake the control thread out of accept() or a client read
+    if (control_path) {
+        shutdown(cfg.control_fd, SHUT_RDWR);
+        fd = __atomic_load_n(&cfg.client_fd, __ATOMIC_SEQ_CST);
+        if (fd >= 0)
+            shutdown(fd, SHUT_RDWR);
+        pthread_join(control, NULL);
+        close(cfg.control_fd);
+        unlink(control_path);
+    }
+
+    // A frame may be hours long, cut its sleep short so the lines are released now
+    pthread_kill(thread1, SIGUSR1);
     pthread_join(thread1, NULL);
 
+    if (cfg.summary_sec) {
+        pthread_mutex_lock(&summary_lock);
+        pthread_cond_signal(&summary_cond);
+        pthread_mutex_unlock(&summary_lock);
+        pthread_join(summary, NULL);
+    }
+
 done:
+    gpio_close(&led);
+    pwm_close(&pwm);
+    pattern_free(&cfg.pattern);
+    free(cfg.log);
+    free(cfg.control.spec);
     closelog();
     return retval;
 
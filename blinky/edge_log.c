@@ -0,0 +1,50 @@
+/*-----------------------------------------------------------------------------
+ * edge_log.c
+ *
+ * Edge record ring for blinky's summary logging, see edge_log.h.
+ *-----------------------------------------------------------------------------
+*/
+#include "edge_log.h"
+
+#define EDGE_LOG_MASK (EDGE_LOG_ENTRIES - 1)
+
+void edge_log_put(struct edge_log *log, const struct edge_record *rec)
+{
+    uint64_t head = log->head;
+
+    log->records[head & EDGE_LOG_MASK] = *rec;
+    // Pairs with the acquire in edge_log_get()
+    __atomic_store_n(&log->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Take the oldest record not yet seen. A record the producer may have been
+ * overwriting while it was copied is discarded and counted as lost.
+ */
+bool edge_log_get(struct edge_log *log, struct edge_record *rec)
+{
+    uint64_t head;
+
+    for (;;) {
+        head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+        if (head - log->tail > EDGE_LOG_ENTRIES) {
+            log->lost += head - log->tail - EDGE_LOG_ENTRIES;
+            log->tail = head - EDGE_LOG_ENTRIES;
+        }
+        if (log->tail == head)
+            return false;
+
+        *rec = log->records[log->tail & EDGE_LOG_MASK];
+
+        // The producer writes index head into the slot of head - ENTRIES
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+        if (head - log->tail < EDGE_LOG_ENTRIES) {
+            log->tail++;
+            return true;
+        }
+
+        log->lost++;
+        log->tail++;
+    }
+}
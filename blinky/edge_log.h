@@ -0,0 +1,35 @@
+/*-----------------------------------------------------------------------------
+ * edge_log.h
+ *
+ * In-memory ring of edge records written by the blinky thread and drained
+ * by the low-priority summary thread, so nothing on the blink path formats
+ * text or calls syslog(). One producer, one consumer, no locks: the
+ * producer never waits and overwrites the oldest record, the consumer
+ * counts what it lost.
+ *-----------------------------------------------------------------------------
+*/
+#ifndef EDGE_LOG_H
+#define EDGE_LOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define EDGE_LOG_ENTRIES 1024   // power of two
+
+struct edge_record {
+    int64_t time_ns;            // scheduled CLOCK_MONOTONIC time of the edge
+    int64_t late_ns;            // how long after time_ns the lines were written
+    uint64_t mask;
+};
+
+struct edge_log {
+    struct edge_record records[EDGE_LOG_ENTRIES];
+    uint64_t head;              // written by the producer only
+    uint64_t tail;              // consumer only
+    unsigned long lost;         // records overwritten before edge_log_get()
+};
+
+void edge_log_put(struct edge_log *log, const struct edge_record *rec);
+bool edge_log_get(struct edge_log *log, struct edge_record *rec);
+
+#endif // EDGE_LOG_H
@@ -0,0 +1,237 @@
+/*-----------------------------------------------------------------------------
+ * gpio_output.c
+ *
+ * Persistent output line handle for blinky, see gpio_output.h.
+ *-----------------------------------------------------------------------------
+*/
+#include <stdio.h>
+#include <syslog.h>
+#include <errno.h>
+#include <string.h>
+
+#include "log.h"
+#include "gpio_output.h"
+
+static int open_chip(struct gpio_output *out)
+{
+    out->chip = gpiod_chip_open(GPIO_CHIP_PATH);
+    if (!out->chip) {
+        syslog(LOG_ERR, "Failed to open GPIO chip");
+        ERROR_PRINT("gpiod_chip_open() failed");
+        fprintf(stderr, "gpiod_chip_open() failed, code: %d, message: %s\n",
+            errno, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static uint64_t lines_mask(unsigned int num_lines)
+{
+    return num_lines == MAX_LINES ? ~0ULL : (1ULL << num_lines) - 1;
+}
+
+#ifdef BLINKY_GPIOD_V2
+
+/*
+ * libgpiod v2: one gpiod_line_request owns every pin. The settings, line
+ * config and request config are built once and kept with the request.
+ */
+static void free_config(struct gpio_output *out)
+{
+    if (out->req_cfg)
+        gpiod_request_config_free(out->req_cfg);
+    if (out->line_cfg)
+        gpiod_line_config_free(out->line_cfg);
+    if (out->settings)
+        gpiod_line_settings_free(out->settings);
+    out->req_cfg = NULL;
+    out->line_cfg = NULL;
+    out->settings = NULL;
+}
+
+int gpio_open(struct gpio_output *out, const unsigned int *pins,
+              unsigned int num_lines, uint64_t mask)
+{
+    unsigned int i;
+
+    out->settings = NULL;
+    out->line_cfg = NULL;
+    out->req_cfg = NULL;
+    out->request = NULL;
+
+    if (open_chip(out) < 0)
+        return -1;
+
+    memcpy(out->pins, pins, num_lines * sizeof(pins[0]));
+    for (i = 0; i < num_lines; i++) {
+        out->values[i] = ((mask >> i) & 1) ? GPIOD_LINE_VALUE_ACTIVE
+                                           : GPIOD_LINE_VALUE_INACTIVE;
+    }
+
+    out->settings = gpiod_line_settings_new();
+    out->line_cfg = gpiod_line_config_new();
+    out->req_cfg = gpiod_request_config_new();
+    if (!out->settings || !out->line_cfg || !out->req_cfg) {
+        syslog(LOG_ERR, "Failed to allocate GPIO line config");
+        ERROR_PRINT("gpiod config allocation failed");
+        goto err_close;
+    }
+
+    if (gpiod_line_settings_set_direction(out->settings,
+                                          GPIOD_LINE_DIRECTION_OUTPUT) < 0 ||
+        gpiod_line_config_add_line_settings(out->line_cfg, out->pins, num_lines,
+                                            out->settings) < 0 ||
+        gpiod_line_config_set_output_values(out->line_cfg, out->values,
+                                            num_lines) < 0) {
+        syslog(LOG_ERR, "Failed to build GPIO line config");
+        ERROR_PRINT("gpiod_line_config_add_line_settings() failed");
+        fprintf(stderr, "gpiod line config failed, code: %d, message: %s\n",
+            errno, strerror(errno));
+        goto err_close;
+    }
+
+    gpiod_request_config_set_consumer(out->req_cfg, "blinky");
+
+    // Request the lines as outputs once; they are held until gpio_close()
+    out->request = gpiod_chip_request_lines(out->chip, out->req_cfg, out->line_cfg);
+    if (!out->request) {
+        syslog(LOG_ERR, "Failed to request GPIO lines for output");
+        ERROR_PRINT("gpiod_chip_request_lines() failed");
+        fprintf(stderr, "gpiod_chip_request_lines() failed, code: %d, message: %s\n",
+            errno, strerror(errno));
+        goto err_close;
+    }
+
+    out->num_lines = num_lines;
+    out->all_mask = lines_mask(num_lines);
+    return 0;
+
+err_close:
+    free_config(out);
+    gpiod_chip_close(out->chip);
+    out->chip = NULL;
+    return -1;
+}
+
+int gpio_write(struct gpio_output *out, uint64_t mask)
+{
+    unsigned int i;
+
+    for (i = 0; i < out->num_lines; i++) {
+        out->values[i] = ((mask >> i) & 1) ? GPIOD_LINE_VALUE_ACTIVE
+                                           : GPIOD_LINE_VALUE_INACTIVE;
+    }
+
+    // One ioctl updates every line of the request at the same time
+    if (gpiod_line_request_set_values(out->request, out->values) < 0) {
+        syslog(LOG_ERR, "Failed to write to GPIO lines");
+        ERROR_PRINT("gpiod_line_request_set_values() failed");
+        fprintf(stderr, "gpiod_line_request_set_values() failed, code: %d, message: %s\n",
+            errno, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+void gpio_close(struct gpio_output *out)
+{
+    if (!out->chip)
+        return;
+
+    // Leave the LEDs off when we release the lines
+    gpio_write(out, 0);
+    gpiod_line_request_release(out->request);
+    out->request = NULL;
+    free_config(out);
+    gpiod_chip_close(out->chip);
+    out->chip = NULL;
+}
+
+#else // libgpiod v1
+
+#if GPIOD_LINE_BULK_MAX_LINES < MAX_LINES
+#error "gpiod_line_bulk cannot hold MAX_LINES lines"
+#endif
+
+/*
+ * libgpiod v1: request every pin as a single gpiod_line_bulk.
+ */
+int gpio_open(struct gpio_output *out, const unsigned int *pins,
+              unsigned int num_lines, uint64_t mask)
+{
+    int values[MAX_LINES];
+    unsigned int i;
+    int ret;
+
+    if (open_chip(out) < 0)
+        return -1;
+
+    // Get the GPIO lines (pins) based on the pin numbers
+    memcpy(out->pins, pins, num_lines * sizeof(pins[0]));
+    ret = gpiod_chip_get_lines(out->chip, out->pins, num_lines, &out->bulk);
+    if (ret < 0) {
+        syslog(LOG_ERR, "Failed to get GPIO lines");
+        ERROR_PRINT("gpiod_chip_get_lines() failed");
+        fprintf(stderr, "gpiod_chip_get_lines() failed, code: %d, message: %s\n",
+            errno, strerror(errno));
+        goto err_close;
+    }
+
+    for (i = 0; i < num_lines; i++)
+        values[i] = (mask >> i) & 1;
+
+    // Request the lines as outputs once; they are held until gpio_close()
+    ret = gpiod_line_request_bulk_output(&out->bulk, "blinky", values);
+    if (ret < 0) {
+        syslog(LOG_ERR, "Failed to request GPIO lines for output");
+        ERROR_PRINT("gpiod_line_request_bulk_output() failed");
+        fprintf(stderr, "gpiod_line_request_bulk_output() failed, code: %d, message: %s\n",
+            errno, strerror(errno));
+        goto err_close;
+    }
+
+    out->num_lines = num_lines;
+    out->all_mask = lines_mask(num_lines);
+    return 0;
+
+err_close:
+    gpiod_chip_close(out->chip);
+    out->chip = NULL;
+    return -1;
+}
+
+int gpio_write(struct gpio_output *out, uint64_t mask)
+{
+    int values[MAX_LINES];
+    unsigned int i;
+
+    for (i = 0; i < out->num_lines; i++)
+        values[i] = (mask >> i) & 1;
+
+    // One ioctl updates every line of the bank at the same time
+    if (gpiod_line_set_value_bulk(&out->bulk, values) < 0) {
+        syslog(LOG_ERR, "Failed to write to GPIO lines");
+        ERROR_PRINT("gpiod_line_set_value_bulk() failed");
+        fprintf(stderr, "gpiod_line_set_value_bulk() failed, code: %d, message: %s\n",
+            errno, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+void gpio_close(struct gpio_output *out)
+{
+    if (!out->chip)
+        return;
+
+    // Leave the LEDs off when we release the lines
+    gpio_write(out, 0);
+    gpiod_line_release_bulk(&out->bulk);
+    gpiod_chip_close(out->chip);
+    out->chip = NULL;
+}
+
+#endif // BLINKY_GPIOD_V2
@@ -0,0 +1,44 @@
+/*-----------------------------------------------------------------------------
+ * gpio_output.h
+ *
+ * Output line handle used by blinky. The lines are requested once, held for
+ * the lifetime of the handle, and written together from a bitmask. Bit n of
+ * a mask drives pins[n].
+ *
+ * Built against the libgpiod v1 API by default, or against the v2 request
+ * API when BLINKY_GPIOD_V2 is defined (make GPIOD_API=2).
+ *-----------------------------------------------------------------------------
+*/
+#ifndef GPIO_OUTPUT_H
+#define GPIO_OUTPUT_H
+
+#include <stdint.h>
+#include <gpiod.h>
+
+#define GPIO_CHIP_PATH "/dev/gpiochip0"
+
+#define MAX_LINES 64    // one bit of a uint64_t mask per line
+
+struct gpio_output {
+    struct gpiod_chip *chip;
+#ifdef BLINKY_GPIOD_V2
+    // Config objects are kept alive with the request so nothing is rebuilt
+    struct gpiod_line_settings *settings;
+    struct gpiod_line_config *line_cfg;
+    struct gpiod_request_config *req_cfg;
+    struct gpiod_line_request *request;
+    enum gpiod_line_value values[MAX_LINES];
+#else
+    struct gpiod_line_bulk bulk;
+#endif
+    unsigned int pins[MAX_LINES];
+    unsigned int num_lines;
+    uint64_t all_mask;          // bit n set for every requested line n
+};
+
+int gpio_open(struct gpio_output *out, const unsigned int *pins,
+              unsigned int num_lines, uint64_t mask);
+int gpio_write(struct gpio_output *out, uint64_t mask);
+void gpio_close(struct gpio_output *out);
+
+#endif // GPIO_OUTPUT_H
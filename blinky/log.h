@@ -0,0 +1,18 @@
+/*-----------------------------------------------------------------------------
+ * log.h
+ *
+ * stderr print macros shared by blinky's output backends and the bench,
+ * kept free of any library dependency.
+ *-----------------------------------------------------------------------------
+*/
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+
+#define DEBUG_PRINT(fmt, ...) \
+    fprintf(stderr, "%s:%d: " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+#define ERROR_PRINT(fmt, ...) \
+    fprintf(stderr, "%s:%d: " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+
+#endif // LOG_H
@@ -0,0 +1,134 @@
+/*-----------------------------------------------------------------------------
+ * pwm_output.c
+ *
+ * PWM output for blinky's brightness mode, see pwm_output.h.
+ *-----------------------------------------------------------------------------
+*/
+#include <stdio.h>
+#include <syslog.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "log.h"
+#include "pwm_output.h"
+
+// Write a value to a sysfs attribute below the PWM chip directory
+static int pwm_sysfs_write(const struct pwm_output *pwm, const char *attr, const char *value)
+{
+    char path[128];
+    ssize_t len = strlen(value);
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/pwmchip%d/%s", PWM_SYSFS_PATH, pwm->chip, attr);
+
+    fd = open(path, O_WRONLY);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Failed to open %s", path);
+        ERROR_PRINT("open() failed");
+        fprintf(stderr, "open(%s) failed, code: %d, message: %s\n",
+            path, errno, strerror(errno));
+        return -1;
+    }
+
+    if (write(fd, value, len) != len) {
+        syslog(LOG_ERR, "Failed to write %s to %s", value, path);
+        ERROR_PRINT("write() failed");
+        fprintf(stderr, "write(%s) failed, code: %d, message: %s\n",
+            path, errno, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+int pwm_open(struct pwm_output *pwm, int chip, int channel,
+             uint64_t period_ns, uint64_t on_duty_ns)
+{
+    char attr[64], value[24];
+
+    pwm->chip = chip;
+    pwm->channel = channel;
+    pwm->duty_fd = -1;
+
+    // Export the channel unless a previous run left it exported
+    snprintf(attr, sizeof(attr), "%s/pwmchip%d/pwm%d", PWM_SYSFS_PATH, chip, channel);
+    snprintf(value, sizeof(value), "%d", channel);
+    if (access(attr, F_OK) < 0 && pwm_sysfs_write(pwm, "export", value) < 0)
+        return -1;
+
+    // duty_cycle may never exceed period, so clear it before changing period
+    snprintf(attr, sizeof(attr), "pwm%d/duty_cycle", channel);
+    if (pwm_sysfs_write(pwm, attr, "0") < 0)
+        goto err_unexport;
+
+    snprintf(attr, sizeof(attr), "pwm%d/period", channel);
+    snprintf(value, sizeof(value), "%" PRIu64, period_ns);
+    if (pwm_sysfs_write(pwm, attr, value) < 0)
+        goto err_unexport;
+
+    snprintf(attr, sizeof(attr), "pwm%d/enable", channel);
+    if (pwm_sysfs_write(pwm, attr, "1") < 0)
+        goto err_unexport;
+
+    snprintf(pwm->on_duty, sizeof(pwm->on_duty), "%" PRIu64, on_duty_ns);
+    snprintf(pwm->off_duty, sizeof(pwm->off_duty), "0");
+
+    snprintf(attr, sizeof(attr), "%s/pwmchip%d/pwm%d/duty_cycle",
+             PWM_SYSFS_PATH, chip, channel);
+    pwm->duty_fd = open(attr, O_WRONLY);
+    if (pwm->duty_fd < 0) {
+        syslog(LOG_ERR, "Failed to open %s", attr);
+        ERROR_PRINT("open() failed");
+        fprintf(stderr, "open(%s) failed, code: %d, message: %s\n",
+            attr, errno, strerror(errno));
+        goto err_unexport;
+    }
+
+    return 0;
+
+err_unexport:
+    snprintf(value, sizeof(value), "%d", channel);
+    pwm_sysfs_write(pwm, "unexport", value);
+    return -1;
+}
+
+int pwm_write(struct pwm_output *pwm, bool on)
+{
+    const char *duty = on ? pwm->on_duty : pwm->off_duty;
+    ssize_t len = strlen(duty);
+
+    // sysfs attributes are rewritten from offset 0, pwrite avoids an lseek
+    if (pwrite(pwm->duty_fd, duty, len, 0) != len) {
+        syslog(LOG_ERR, "Failed to write PWM duty cycle");
+        ERROR_PRINT("pwrite() failed");
+        fprintf(stderr, "pwrite() failed, code: %d, message: %s\n",
+            errno, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+void pwm_close(struct pwm_output *pwm)
+{
+    char attr[64], value[24];
+
+    if (pwm->duty_fd < 0)
+        return;
+
+    // Leave the LED off and hand the channel back
+    pwm_write(pwm, false);
+    close(pwm->duty_fd);
+    pwm->duty_fd = -1;
+
+    snprintf(attr, sizeof(attr), "pwm%d/enable", pwm->channel);
+    pwm_sysfs_write(pwm, attr, "0");
+
+    snprintf(value, sizeof(value), "%d", pwm->channel);
+    pwm_sysfs_write(pwm, "unexport", value);
+}
@@ -0,0 +1,33 @@
+/*-----------------------------------------------------------------------------
+ * pwm_output.h
+ *
+ * PWM output used by blinky's brightness mode, driven through the kernel PWM
+ * sysfs interface (/sys/class/pwm). On the RPi 4 GPIO 18 is PWM0 channel 0
+ * once the pin is muxed to the PWM (dtoverlay=pwm).
+ *
+ * The on/off duty strings are rendered once in pwm_open(), so each edge is a
+ * single pwrite() of the duty_cycle attribute.
+ *-----------------------------------------------------------------------------
+*/
+#ifndef PWM_OUTPUT_H
+#define PWM_OUTPUT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PWM_SYSFS_PATH "/sys/class/pwm"
+
+struct pwm_output {
+    int chip;
+    int channel;
+    int duty_fd;            // duty_cycle, kept open for the hot path
+    char on_duty[24];
+    char off_duty[24];
+};
+
+int pwm_open(struct pwm_output *pwm, int chip, int channel,
+             uint64_t period_ns, uint64_t on_duty_ns);
+int pwm_write(struct pwm_output *pwm, bool on);
+void pwm_close(struct pwm_output *pwm);
+
+#endif // PWM_OUTPUT_H
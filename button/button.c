@@ -1,11 +1,16 @@
 /*-----------------------------------------------------------------------------
  * button.c
  *
- * Application that polls the /dev/gpio_button device descriptor and waits
- * for button events. When an event is detected, it stops polling for 5 seconds
- * and toggles the button LED state via the sysfs interface provided by the
- * driver.
- * 
+ * Application that reads button events from one or more gpio_button device
+ * descriptors and toggles each button's LED on every press with the driver's
+ * GPIO_BUTTON_IOC_LED ioctl.
+ *
+ * A single epoll loop watches every device, a signalfd for SIGINT/SIGTERM
+ * and a timerfd for the periodic status line, so one process can serve any
+ * number of buttons without a thread per device. Built with IO_URING=1 the
+ * same loop runs on io_uring instead: reads and LED writes for all devices
+ * are submitted in one batch and completions are reaped from the ring.
+ *
  * Steve Dunnagan
  *-----------------------------------------------------------------------------
 */
@@ -16,104 +21,495 @@
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
-#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#ifdef BUTTON_IO_URING
+#include <poll.h>
+#include <liburing.h>
+#endif
 
-#define GPIO_BUTTON_DEVICE "/dev/gpio_button"
-#define GPIO_LED_SYSFS_PATH "/sys/class/gpio_button/gpio_button_sysfs/led_status"
+#include "gpio_button.h"
 
-static volatile sig_atomic_t keep_running = 1;
+#define GPIO_BUTTON_DEVICE  "/dev/gpio_button"
+#define MAX_DEVICES         32
+#define MAX_EVENTS_PER_READ 64
+#define MAX_EPOLL_EVENTS    (MAX_DEVICES + 2)
+#define STATUS_INTERVAL_SEC 5
+#define SYSFS_CLASS_PATH    "/sys/class/gpio_button"
+#define URING_ENTRIES       (4 * MAX_DEVICES)
 
-void sigint_handler(int sig)
+// One entry per opened gpio_button device
+struct button_dev {
+    const char *path;
+    int fd;
+    int led_state;
+    bool led_pending;           // odd number of presses since the last flush
+    unsigned long presses;
+    unsigned long reported;     // presses at the last status line
+#ifdef BUTTON_IO_URING
+    int led_fd;                 // <name>_sysfs/led_status, written with "toggle"
+    bool led_busy;              // an LED write is in flight
+    char led_buf[8];            // led_status read back after the write
+    struct gpio_button_event events[MAX_EVENTS_PER_READ];
+#endif
+};
+
+// One ioctl per LED update, returns the LED state reported by the driver
+static int led_control(int fd, unsigned int op)
 {
-    keep_running = 0;
+    struct gpio_button_led led = { .op = op };
+
+    if (ioctl(fd, GPIO_BUTTON_IOC_LED, &led) < 0)
+        return -1;
+
+    return led.value;
 }
 
-int main()
+// Only the parity of presses survives to the LED flush.
+// Presses the driver already handled in its fast path are skipped.
+static void count_presses(struct button_dev *dev,
+                          const struct gpio_button_event *events, ssize_t len)
 {
-    int button_fd = -1, led_fd = -1;
-    char event_flag;
-    char led_value[2];
-    int current_led_state = 0;
-    int retval = EXIT_SUCCESS;
+    int i;
 
-    // Register SIGINT handler
-    struct sigaction sa;
-    sa.sa_handler = sigint_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
-    if (sigaction(SIGINT, &sa, NULL) < 0) {
-        fprintf(stderr, "Failed to register signal handler: %s\n", strerror(errno));
-        retval = EXIT_FAILURE;
-        goto cleanup;
+    for (i = 0; i < len / (ssize_t)sizeof(events[0]); i++) {
+        if (events[i].type == GPIO_BUTTON_EV_PRESS &&
+            !(events[i].flags & GPIO_BUTTON_EVF_LED_TOGGLED)) {
+            dev->led_pending = !dev->led_pending;
+            dev->presses++;
+        }
     }
+}
 
-    // Open LED sysfs ONCE (read/write mode)
-    led_fd = open(GPIO_LED_SYSFS_PATH, O_RDWR);
-    if (led_fd < 0) {
-        fprintf(stderr, "Failed to open LED sysfs: %s\n", strerror(errno));
-        retval = EXIT_FAILURE;
-        goto cleanup;
+// Printed from the timerfd instead of on every press
+static void print_status(struct button_dev *devs, int num_devs)
+{
+    int i;
+
+    for (i = 0; i < num_devs; i++) {
+        if (devs[i].presses == devs[i].reported)
+            continue;
+        printf("%s: %lu presses, LED %d\n", devs[i].path, devs[i].presses,
+               devs[i].led_state);
+        devs[i].reported = devs[i].presses;
     }
+    fflush(stdout);
+}
 
-    // Read initial LED state
-    if (read(led_fd, led_value, sizeof(led_value)) <= 0) {
-        fprintf(stderr, "Failed to read initial LED state: %s\n", strerror(errno));
-        retval = EXIT_FAILURE;
-        goto cleanup;
+#ifndef BUTTON_IO_URING
+
+// epoll data for the non-device descriptors, devices use their index
+#define EPOLL_ID_SIGNAL ((uint64_t)-1)
+#define EPOLL_ID_TIMER  ((uint64_t)-2)
+
+// Drain every queued event until the reader caught up with the ring
+static int drain_events(struct button_dev *dev)
+{
+    struct gpio_button_event events[MAX_EVENTS_PER_READ];
+    ssize_t n;
+
+    for (;;) {
+        n = read(dev->fd, events, sizeof(events));
+        if (n < 0) {
+            if (errno == EAGAIN)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "%s: read error: %s\n", dev->path, strerror(errno));
+            return -1;
+        }
+
+        count_presses(dev, events, n);
+
+        // A short read means the ring is empty for this reader
+        if (n < (ssize_t)sizeof(events))
+            return 0;
+    }
+}
+
+// At most one LED ioctl per device per loop iteration, however many presses
+static int flush_led(struct button_dev *dev)
+{
+    int state;
+
+    if (!dev->led_pending)
+        return 0;
+
+    state = led_control(dev->fd, GPIO_BUTTON_LED_TOGGLE);
+    if (state < 0) {
+        fprintf(stderr, "%s: LED toggle failed: %s\n", dev->path, strerror(errno));
+        return -1;
+    }
+
+    dev->led_state = state;
+    dev->led_pending = false;
+    return 0;
+}
+
+static int epoll_add(int epfd, int fd, uint32_t events, uint64_t id)
+{
+    struct epoll_event ev = { .events = events, .data.u64 = id };
+
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int event_loop(struct button_dev *devs, int num_devs, int sfd, int tfd)
+{
+    struct epoll_event ready[MAX_EPOLL_EVENTS];
+    struct signalfd_siginfo si;
+    uint64_t expirations;
+    int epfd;
+    int i, n;
+    int retval = EXIT_FAILURE;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0 ||
+        epoll_add(epfd, sfd, EPOLLIN, EPOLL_ID_SIGNAL) < 0 ||
+        epoll_add(epfd, tfd, EPOLLIN, EPOLL_ID_TIMER) < 0) {
+        fprintf(stderr, "Failed to set up epoll: %s\n", strerror(errno));
+        goto out;
+    }
+    for (i = 0; i < num_devs; i++) {
+        if (epoll_add(epfd, devs[i].fd, EPOLLIN, i) < 0) {
+            fprintf(stderr, "%s: epoll_ctl failed: %s\n", devs[i].path, strerror(errno));
+            goto out;
+        }
+    }
+
+    for (;;) {
+        n = epoll_wait(epfd, ready, MAX_EPOLL_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            goto out;
+        }
+
+        for (i = 0; i < n; i++) {
+            switch (ready[i].data.u64) {
+            case EPOLL_ID_SIGNAL:
+                if (read(sfd, &si, sizeof(si)) == sizeof(si)) {
+                    retval = EXIT_SUCCESS;
+                    goto out;
+                }
+                break;
+            case EPOLL_ID_TIMER:
+                if (read(tfd, &expirations, sizeof(expirations)) == sizeof(expirations))
+                    print_status(devs, num_devs);
+                break;
+            default:
+                if (drain_events(&devs[ready[i].data.u64]) < 0)
+                    goto out;
+                break;
+            }
+        }
+
+        // LED updates are issued once everything ready has been drained
+        for (i = 0; i < num_devs; i++) {
+            if (flush_led(&devs[i]) < 0)
+                goto out;
+        }
+    }
+
+out:
+    if (epfd >= 0)
+        close(epfd);
+    return retval;
+}
+
+#else /* BUTTON_IO_URING */
+
+// user_data is the operation in the high word and the device in the low word
+enum uring_op {
+    URING_OP_READ,
+    URING_OP_LED,
+    URING_OP_SIGNAL,
+    URING_OP_TIMER,
+};
+
+#define URING_DATA(op, idx)  (((uint64_t)(op) << 32) | (uint32_t)(idx))
+#define URING_DATA_OP(data)  ((enum uring_op)((data) >> 32))
+#define URING_DATA_IDX(data) ((int)(uint32_t)(data))
+
+static const char led_toggle_cmd[] = "toggle";
+
+// The sysfs node is named after the device node: gpio_button1 -> gpio_button1_sysfs
+static int open_led_status(struct button_dev *dev)
+{
+    const char *name = strrchr(dev->path, '/');
+    char path[128];
+
+    name = name ? name + 1 : dev->path;
+    snprintf(path, sizeof(path), "%s/%s_sysfs/led_status", SYSFS_CLASS_PATH, name);
+
+    dev->led_fd = open(path, O_RDWR | O_CLOEXEC);
+    if (dev->led_fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
     }
-    current_led_state = atoi(led_value);
 
-    // Open button device
-    button_fd = open(GPIO_BUTTON_DEVICE, O_RDONLY);
-    if (button_fd < 0) {
-        fprintf(stderr, "Failed to open GPIO button device: %s\n", strerror(errno));
+    return 0;
+}
+
+static struct io_uring_sqe *get_sqe(struct io_uring *ring)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+
+    // The ring is sized for every device's worst case, flush if it ever fills
+    if (!sqe) {
+        io_uring_submit(ring);
+        sqe = io_uring_get_sqe(ring);
+    }
+
+    return sqe;
+}
+
+// Poll linked to a read: the read only runs once the descriptor is readable,
+// since io_uring completes reads on O_NONBLOCK files with -EAGAIN rather
+// than waiting. The successful poll posts no completion of its own.
+static void queue_read(struct io_uring *ring, int fd, void *buf, unsigned int len,
+                       uint64_t data)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = get_sqe(ring);
+    io_uring_prep_poll_add(sqe, fd, POLLIN);
+    io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS);
+    io_uring_sqe_set_data64(sqe, data);
+
+    sqe = get_sqe(ring);
+    io_uring_prep_read(sqe, fd, buf, len, 0);
+    io_uring_sqe_set_data64(sqe, data);
+}
+
+static void queue_dev_read(struct io_uring *ring, struct button_dev *dev, int idx)
+{
+    queue_read(ring, dev->fd, dev->events, sizeof(dev->events),
+               URING_DATA(URING_OP_READ, idx));
+}
+
+/*
+ * One "toggle" write per device in flight, later presses fold into the next.
+ * sysfs writes only return the byte count, so a linked read of led_status
+ * takes the driver's state in the same submission; the successful write
+ * posts no completion of its own.
+ */
+static void queue_led(struct io_uring *ring, struct button_dev *dev, int idx)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!dev->led_pending || dev->led_busy)
+        return;
+
+    sqe = get_sqe(ring);
+    io_uring_prep_write(sqe, dev->led_fd, led_toggle_cmd, sizeof(led_toggle_cmd) - 1, 0);
+    io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS);
+    io_uring_sqe_set_data64(sqe, URING_DATA(URING_OP_LED, idx));
+
+    sqe = get_sqe(ring);
+    io_uring_prep_read(sqe, dev->led_fd, dev->led_buf, sizeof(dev->led_buf) - 1, 0);
+    io_uring_sqe_set_data64(sqe, URING_DATA(URING_OP_LED, idx));
+    dev->led_pending = false;
+    dev->led_busy = true;
+}
+
+static int event_loop(struct button_dev *devs, int num_devs, int sfd, int tfd)
+{
+    struct io_uring ring;
+    struct io_uring_cqe *cqe;
+    struct signalfd_siginfo si;
+    struct button_dev *dev;
+    uint64_t expirations;
+    unsigned int head, seen;
+    int i, ret;
+    bool keep_running = true;
+    int retval = EXIT_SUCCESS;
+
+    for (i = 0; i < num_devs; i++) {
+        if (open_led_status(&devs[i]) < 0) {
+            retval = EXIT_FAILURE;
+            goto out_fds;
+        }
+    }
+
+    ret = io_uring_queue_init(URING_ENTRIES, &ring, 0);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_queue_init failed: %s\n", strerror(-ret));
         retval = EXIT_FAILURE;
-        goto cleanup;
+        goto out_fds;
     }
 
-    printf("LED Control App - Initial State: %d\n", current_led_state);
+    queue_read(&ring, sfd, &si, sizeof(si), URING_DATA(URING_OP_SIGNAL, 0));
+    queue_read(&ring, tfd, &expirations, sizeof(expirations),
+               URING_DATA(URING_OP_TIMER, 0));
+    for (i = 0; i < num_devs; i++)
+        queue_dev_read(&ring, &devs[i], i);
 
     while (keep_running) {
-        // Block until button event
-        if (read(button_fd, &event_flag, sizeof(event_flag)) < 0) {
-            if (errno == EINTR) break; // SIGINT received
-            fprintf(stderr, "Read error: %s\n", strerror(errno));
+        // One io_uring_enter() submits the whole batch and waits for work
+        ret = io_uring_submit_and_wait(&ring, 1);
+        if (ret < 0) {
+            if (ret == -EINTR)
+                continue;
+            fprintf(stderr, "io_uring_submit_and_wait failed: %s\n", strerror(-ret));
             retval = EXIT_FAILURE;
-            goto cleanup;
+            break;
+        }
+
+        // Completions are reaped straight from the shared CQ ring
+        seen = 0;
+        io_uring_for_each_cqe(&ring, head, cqe) {
+            uint64_t data = io_uring_cqe_get_data64(cqe);
+
+            seen++;
+            dev = &devs[URING_DATA_IDX(data)];
+
+            switch (URING_DATA_OP(data)) {
+            case URING_OP_SIGNAL:
+                if (cqe->res == sizeof(si))
+                    keep_running = false;
+                else
+                    queue_read(&ring, sfd, &si, sizeof(si), data);
+                break;
+            case URING_OP_TIMER:
+                if (cqe->res == sizeof(expirations))
+                    print_status(devs, num_devs);
+                queue_read(&ring, tfd, &expirations, sizeof(expirations), data);
+                break;
+            case URING_OP_READ:
+                if (cqe->res < 0 && cqe->res != -EAGAIN) {
+                    fprintf(stderr, "%s: read error: %s\n", dev->path, strerror(-cqe->res));
+                    keep_running = false;
+                    retval = EXIT_FAILURE;
+                    break;
+                }
+                if (cqe->res > 0)
+                    count_presses(dev, dev->events, cqe->res);
+                queue_dev_read(&ring, dev, URING_DATA_IDX(data));
+                break;
+            case URING_OP_LED:
+                // The read of a failed write, already reported
+                if (cqe->res == -ECANCELED)
+                    break;
+                dev->led_busy = false;
+                if (cqe->res <= 0) {
+                    fprintf(stderr, "%s: LED toggle failed: %s\n", dev->path,
+                            strerror(cqe->res ? -cqe->res : EIO));
+                    keep_running = false;
+                    retval = EXIT_FAILURE;
+                    break;
+                }
+                dev->led_buf[cqe->res] = '\0';
+                dev->led_state = atoi(dev->led_buf);
+                break;
+            }
         }
+        io_uring_cq_advance(&ring, seen);
+
+        // LED writes ride along with the next submission
+        for (i = 0; i < num_devs; i++)
+            queue_led(&ring, &devs[i], i);
+    }
+
+    io_uring_queue_exit(&ring);
+
+out_fds:
+    for (i = 0; i < num_devs; i++) {
+        if (devs[i].led_fd >= 0)
+            close(devs[i].led_fd);
+    }
+    return retval;
+}
+
+#endif /* BUTTON_IO_URING */
+
+int main(int argc, char *argv[])
+{
+    struct button_dev devs[MAX_DEVICES];
+    struct itimerspec status_interval = {
+        .it_interval = { .tv_sec = STATUS_INTERVAL_SEC },
+        .it_value = { .tv_sec = STATUS_INTERVAL_SEC },
+    };
+    sigset_t mask;
+    int num_devs = argc > 1 ? argc - 1 : 1;
+    int sfd = -1, tfd = -1;
+    int i;
+    int retval = EXIT_SUCCESS;
+
+    if (num_devs > MAX_DEVICES) {
+        fprintf(stderr, "Usage: %s [device ...] (at most %d devices)\n",
+                argv[0], MAX_DEVICES);
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < num_devs; i++) {
+        devs[i] = (struct button_dev) {
+            .path = argc > 1 ? argv[i + 1] : GPIO_BUTTON_DEVICE,
+            .fd = -1,
+#ifdef BUTTON_IO_URING
+            .led_fd = -1,
+#endif
+        };
+    }
 
-        // Toggle LED state
-        current_led_state = !current_led_state;
-        snprintf(led_value, sizeof(led_value), "%d", current_led_state);
+    // SIGINT/SIGTERM are delivered through the signalfd, not a handler
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+        fprintf(stderr, "Failed to block signals: %s\n", strerror(errno));
+        retval = EXIT_FAILURE;
+        goto cleanup;
+    }
 
-        // Reset file offset and write to LED sysfs
-        if (lseek(led_fd, 0, SEEK_SET) < 0) {
-            fprintf(stderr, "lseek failed: %s\n", strerror(errno));
+    sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (sfd < 0 || tfd < 0 || timerfd_settime(tfd, 0, &status_interval, NULL) < 0) {
+        fprintf(stderr, "Failed to set up signalfd/timerfd: %s\n", strerror(errno));
+        retval = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    // Open button devices non-blocking, each also carries its LED ioctl
+    for (i = 0; i < num_devs; i++) {
+        devs[i].fd = open(devs[i].path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (devs[i].fd < 0) {
+            fprintf(stderr, "Failed to open %s: %s\n", devs[i].path, strerror(errno));
             retval = EXIT_FAILURE;
             goto cleanup;
         }
 
-        if (write(led_fd, led_value, 1) < 0) {
-            fprintf(stderr, "LED write failed: %s\n", strerror(errno));
+        // Read initial LED state
+        devs[i].led_state = led_control(devs[i].fd, GPIO_BUTTON_LED_GET);
+        if (devs[i].led_state < 0) {
+            fprintf(stderr, "%s: failed to read initial LED state: %s\n",
+                    devs[i].path, strerror(errno));
             retval = EXIT_FAILURE;
             goto cleanup;
         }
 
-        printf("LED Toggled → %d\n", current_led_state);
+        printf("LED Control App - %s Initial State: %d\n", devs[i].path,
+               devs[i].led_state);
     }
 
+    retval = event_loop(devs, num_devs, sfd, tfd);
+
 cleanup:
     printf("\nCleaning up...\n");
+    print_status(devs, num_devs);
 
-    if (led_fd >= 0) {
-        lseek(led_fd, 0, SEEK_SET);
-        write(led_fd, "0", 1);
-        close(led_fd);
-    }
-
-    if (button_fd >= 0) {
-        close(button_fd);
+    for (i = 0; i < num_devs; i++) {
+        if (devs[i].fd >= 0) {
+            led_control(devs[i].fd, GPIO_BUTTON_LED_CLEAR);
+            close(devs[i].fd);
+        }
     }
+    if (tfd >= 0)
+        close(tfd);
+    if (sfd >= 0)
+        close(sfd);
 
     return retval;
 }
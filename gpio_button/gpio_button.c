@@ -18,278 +18,1962 @@
 #include <linux/platform_device.h>
 #include <linux/of.h>
 #include <linux/of_gpio.h>
+#include <linux/property.h>
 #include <linux/jiffies.h>
 #include <linux/delay.h>
 #include <linux/sysfs.h>
 #include <linux/atomic.h>
-#include <linux/timer.h>
+#include <linux/idr.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/uaccess.h>
+#include <linux/pwm.h>
+#include <linux/workqueue.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/bitmap.h>
+#include <linux/hrtimer.h>
+#include <linux/pm_runtime.h>
+#include <linux/pm_wakeup.h>
+#include <linux/leds.h>
+#include <linux/kref.h>
+
+#include "gpio_button.h"
+
+#define CREATE_TRACE_POINTS
+#include "gpio_button_trace.h"
 
 #define DRIVER_NAME "gpio_button"
+#define GPIO_BUTTON_MAX_DEVICES 32
+#define RING_MASK               (GPIO_BUTTON_RING_ENTRIES - 1)
+#define READ_BATCH              8       // records copied per ring snapshot
+#define DEFAULT_DEBOUNCE_US     50000
+#define MAX_DEBOUNCE_US         1000000
+#define MAX_BRIGHTNESS          255
+#define LATENCY_BUCKETS         24      // log2 us, the last one is open ended
+#define MAX_GESTURE_MS          10000
+#define GPIO_BUTTON_MAX_LINES   32      // grouped mode, one bit of value per line
+#define MATRIX_MAX_ROWS         16
+#define MATRIX_MAX_COLS         16
+#define MATRIX_MAX_KEYS         (MATRIX_MAX_ROWS * MATRIX_MAX_COLS)
+#define MATRIX_SETTLE_US        5       // row select to column sample
+#define DEFAULT_SCAN_INTERVAL_US 10000
+#define MIN_SCAN_INTERVAL_US    100
+#define AUTOSUSPEND_DELAY_MS    1000    // idle after the last reader closes
+#define MAX_BLINK_MS            60000
+#define DEFAULT_BLINK_MS        500     // LED class blink_set without delays
+#define MAX_AUX_LEDS            8
+
+// Counters under <sysfs_dev>/stats, cleared through stats/reset
+struct gpio_button_stats {
+    atomic_long_t irqs;                 // every edge that reached the driver
+    atomic_long_t debounce_rejects;     // edges ignored inside a debounce window
+    atomic_long_t events;               // records published to the ring
+    atomic_long_t ghosts;               // matrix scans dropped for ghosting
+    atomic_long_t resumes;              // system resumes
+    atomic_long_t resume_latency_us;    // last resume to the first record after it
+    atomic_long_t latency[LATENCY_BUCKETS];  // edge to read() return, see below
+};
+
+/*
+ * Matrix keypad mode: rows are driven one at a time from an hrtimer and the
+ * columns read back as one array. Row and column GPIOs use logical values,
+ * the DT flags (usually GPIO_ACTIVE_LOW) describe the wiring.
+ */
+struct gpio_button_matrix {
+    struct gpio_button_dev *bdev;
+    struct gpio_descs *row_gpios;
+    struct gpio_descs *col_gpios;
+    struct hrtimer scan_timer;
+    u32 scan_interval_us;               // DT "scan-interval-us", sysfs scan_interval_us
+    u16 key_state[MATRIX_MAX_ROWS];     // debounced, bit c = column c pressed
+    u8 key_count[MATRIX_MAX_KEYS];      // consecutive scans a key read changed
+    ktime_t key_change_time[MATRIX_MAX_KEYS];  // first scan that saw the change
+    ktime_t key_press_time[MATRIX_MAX_KEYS];
+};
+
+// DT "aux-led-gpios": LED-only lines, nothing but a LED class device each
+struct gpio_button_aux_led {
+    struct led_classdev cdev;
+    struct gpio_desc *gpio;
+};
+
+/*
+ * Per button/LED pair state, one instance per matching DT node. Open files
+ * hold a reference, so it outlives gpio_remove() until the last release.
+ */
+struct gpio_button_dev {
+    struct kref kref;
+    bool dead;                      // gpio_remove() ran, set under led_lock and readers_lock
+    struct gpio_desc *button_gpio;
+    struct gpio_descs *button_gpios;    // grouped mode, NULL for a single button
+    struct gpio_button_matrix *matrix;  // matrix mode, no button IRQs at all
+    struct gpio_desc *led_gpio;     // optional when the LED has a PWM
+    struct pwm_device *pwm;         // DT "pwms", NULL for a plain GPIO LED
+    int irqs[GPIO_BUTTON_MAX_LINES];    // one per button line
+    unsigned int num_irqs;              // requested so far
+    int id;                         // minor offset and device name suffix
+    struct device *dev;             // the platform device, for runtime PM, referenced
+    dev_t devt;
+    struct cdev *c_dev;             // dynamic, may outlive the instance
+    struct device *char_dev;        // /dev/gpio_button[N]
+    struct device *sysfs_dev;       // holds the sysfs attributes
+    u32 debounce_us;                // DT "debounce-us", sysfs debounce_us
+    atomic_t debounce_active;       // IRQ that owns the debounce window, 0 if none
+    ktime_t edge_time;              // taken in the hard IRQ handler
+    ktime_t press_time;             // edge time of the last reported press
+    bool pressed;                   // last debounced state reported
+    u32 group_state;                // grouped mode: bit n = line n pressed
+    struct list_head readers;       // open files, each with its own wait queue
+    spinlock_t readers_lock;
+    // Broadcast ring, the IRQ thread writes under ring_lock, readers retry
+    struct gpio_button_ring *ring;
+    seqlock_t ring_lock;
+    atomic_t overflows;             // records lost by any reader
+    struct mutex led_lock;          // serializes LED updates from all paths
+    int led_status;                 // what was asked for, blinking while blink_*_ms set
+    int led_hw;                     // last value driven, -1 = unknown
+    unsigned int brightness;        // PWM duty while on, 0..MAX_BRIGHTNESS
+    // Timed blink in the lit state, off unless both are set (sysfs blink_*_ms)
+    u32 blink_on_ms;
+    u32 blink_off_ms;
+    bool blink_phase;               // in the on half of the blink cycle
+    struct delayed_work blink_work;
+    struct led_classdev led_cdev;   // the same LED in /sys/class/leds, for triggers
+    struct gpio_descs *aux_led_gpios;
+    struct gpio_button_aux_led *aux_leds;
+    bool fast_toggle;               // DT "toggle-led-on-press", sysfs fast_toggle
+    struct gpio_button_stats stats;
+    // Gesture recognizer, every threshold is 0 (off) unless configured
+    u32 long_press_ms;              // DT "long-press-ms", sysfs long_press_ms
+    u32 double_click_ms;            // DT "double-click-ms", sysfs double_click_ms
+    u32 chord_group;                // DT "chord-group", sysfs chord_group
+    struct delayed_work long_press_work;
+    ktime_t release_time;           // edge time of the last reported release
+    bool click_armed;               // the last release may start a double click
+    bool click_second;              // the current press completed a double click
+    struct list_head node;          // on gpio_button_list, for chords
+    // System sleep
+    bool wake_armed;                // IRQs armed as wakeup sources at suspend
+    ktime_t resume_time;
+    atomic_t resume_pending;        // no record published since resume_time
+};
+
+// Per open file state, every reader sees every event its filter accepts
+struct gpio_button_reader {
+    struct gpio_button_dev *bdev;
+    struct gpio_button_cursor *cursor;  // mappable at GPIO_BUTTON_OFF_CURSOR
+    struct mutex read_lock;
+    struct list_head node;              // on bdev->readers
+    wait_queue_head_t wait;             // read() and poll() of this file only
+    // GPIO_BUTTON_IOC_FILTER, evaluated by the producer under ring_lock
+    u32 type_mask;                      // BIT(type) accepted, 0 = all types
+    u64 rate_limit_ns;                  // minimum spacing of accepted records
+    u64 last_accept_ns;                 // publish time of the last accepted record
+    DECLARE_BITMAP(accepted, GPIO_BUTTON_RING_ENTRIES);  // per ring slot
+};
+
+static dev_t dev_base;
+static struct class *cl;
+static DEFINE_IDA(gpio_button_ida);
+// Instances by minor offset, open() takes its reference under the lock
+static struct gpio_button_dev *gpio_button_minors[GPIO_BUTTON_MAX_DEVICES];
+static DEFINE_MUTEX(gpio_button_minors_lock);
+// Every probed instance, chords are recognized across them
+static LIST_HEAD(gpio_button_list);
+static DEFINE_SPINLOCK(gpio_button_list_lock);
+
+static bool button_pressed(struct gpio_button_dev *bdev)
+{
+    int val = gpiod_get_value_cansleep(bdev->button_gpio);
+
+    // On a read error keep the last state, nothing is reported
+    if (val < 0)
+        return bdev->pressed;
+
+    return val == 0;  // Assuming active-low button
+}
+
+// Every line of a group in one gpiod_get_array_value call, as a pressed bitmap
+static u32 group_pressed(struct gpio_button_dev *bdev)
+{
+    struct gpio_descs *descs = bdev->button_gpios;
+    unsigned long values = 0;
+    int ret;
+
+    ret = gpiod_get_array_value_cansleep(descs->ndescs, descs->desc, descs->info, &values);
+    if (ret < 0)
+        return bdev->group_state;
+
+    // Active-low like the single button
+    return ~values & GENMASK(descs->ndescs - 1, 0);
+}
+
+// Debounced state in either mode, compared against a fresh sample
+static u32 button_state(struct gpio_button_dev *bdev)
+{
+    return bdev->button_gpios ? bdev->group_state : bdev->pressed;
+}
+
+static u32 button_sample(struct gpio_button_dev *bdev)
+{
+    return bdev->button_gpios ? group_pressed(bdev) : button_pressed(bdev);
+}
+
+static bool led_blinking(struct gpio_button_dev *bdev)
+{
+    return bdev->blink_on_ms && bdev->blink_off_ms;
+}
+
+/*
+ * Drive the LED hardware from led_status, the blink phase and brightness,
+ * led_lock held. Nothing is written when the output would not change unless
+ * force is set (new brightness, controllers that lost state). The PWM stays
+ * enabled at 0% while off so the pin never floats.
+ */
+static void led_update(struct gpio_button_dev *bdev, bool force)
+{
+    struct pwm_state state;
+    int on = bdev->led_status && (!led_blinking(bdev) || bdev->blink_phase);
+
+    if (!force && on == bdev->led_hw)
+        return;
+
+    if (bdev->pwm) {
+        pwm_init_state(bdev->pwm, &state);
+        state.enabled = true;
+        pwm_set_relative_duty_cycle(&state, on ? bdev->brightness : 0, MAX_BRIGHTNESS);
+        pwm_apply_state(bdev->pwm, &state);
+    }
+
+    if (bdev->led_gpio)
+        gpiod_set_value_cansleep(bdev->led_gpio, on);
+
+    bdev->led_hw = on;
+}
+
+// (Re)start the blink cycle lit, or stop it, after led_status or blink_*_ms changed
+static void led_blink_restart(struct gpio_button_dev *bdev)
+{
+    bdev->blink_phase = true;
+
+    if (bdev->led_status && led_blinking(bdev)) {
+        mod_delayed_work(system_power_efficient_wq, &bdev->blink_work,
+                         msecs_to_jiffies(bdev->blink_on_ms));
+    } else {
+        // Not _sync under led_lock, the work re-checks under the lock
+        cancel_delayed_work(&bdev->blink_work);
+    }
+}
+
+static void led_blink_work_fn(struct work_struct *work)
+{
+    struct gpio_button_dev *bdev = container_of(to_delayed_work(work),
+                                                struct gpio_button_dev, blink_work);
+
+    mutex_lock(&bdev->led_lock);
+
+    if (bdev->led_status && led_blinking(bdev)) {
+        bdev->blink_phase = !bdev->blink_phase;
+        led_update(bdev, false);
+        queue_delayed_work(system_power_efficient_wq, &bdev->blink_work,
+                           msecs_to_jiffies(bdev->blink_phase ? bdev->blink_on_ms
+                                                              : bdev->blink_off_ms));
+    }
+
+    mutex_unlock(&bdev->led_lock);
+}
+
+/*
+ * Apply a GPIO_BUTTON_LED_* operation and return the resulting LED state.
+ * Shared by the ioctl and sysfs paths, nothing here logs. An operation that
+ * leaves led_status as it was touches no hardware.
+ */
+static int led_apply(struct gpio_button_dev *bdev, u32 op)
+{
+    int old, state;
+
+    mutex_lock(&bdev->led_lock);
+
+    // The LED GPIO/PWM go away with the driver, files may still be open
+    if (bdev->dead) {
+        mutex_unlock(&bdev->led_lock);
+        return -ENODEV;
+    }
+
+    old = bdev->led_status;
+
+    switch (op) {
+    case GPIO_BUTTON_LED_GET:
+        break;
+    case GPIO_BUTTON_LED_CLEAR:
+        bdev->led_status = 0;
+        break;
+    case GPIO_BUTTON_LED_SET:
+        bdev->led_status = 1;
+        break;
+    case GPIO_BUTTON_LED_TOGGLE:
+        bdev->led_status = !bdev->led_status;
+        break;
+    default:
+        mutex_unlock(&bdev->led_lock);
+        return -EINVAL;
+    }
+
+    if (bdev->led_status != old) {
+        led_blink_restart(bdev);
+        led_update(bdev, false);
+        trace_gpio_button_led(bdev->id, op, bdev->led_status);
+    }
+
+    state = bdev->led_status;
+    mutex_unlock(&bdev->led_lock);
+
+    return state;
+}
+
+/*
+ * The rate limit runs on publish time, not the record's timestamp: gestures
+ * carry the timestamp of the press they complete, so spacing them by edge
+ * time would drop a LONG_PRESS published a second after its PRESS.
+ */
+static bool reader_accepts(struct gpio_button_reader *reader,
+                           const struct gpio_button_event *ev, u64 now)
+{
+    if (reader->type_mask && !(reader->type_mask & BIT(ev->type)))
+        return false;
+
+    if (reader->rate_limit_ns && reader->last_accept_ns &&
+        now - reader->last_accept_ns < reader->rate_limit_ns)
+        return false;
+
+    reader->last_accept_ns = now;
+    return true;
+}
+
+/*
+ * Decide once per reader whether it gets the record at seq. A reader that
+ * was caught up skips a rejected record straight away, so it is neither
+ * woken for it nor sees it pending in poll().
+ */
+static void readers_filter(struct gpio_button_dev *bdev, const struct gpio_button_event *ev)
+{
+    struct gpio_button_reader *reader;
+    u64 now = ktime_get_ns();
+
+    spin_lock(&bdev->readers_lock);
+    list_for_each_entry(reader, &bdev->readers, node) {
+        if (reader_accepts(reader, ev, now)) {
+            __set_bit(ev->seq & RING_MASK, reader->accepted);
+        } else {
+            __clear_bit(ev->seq & RING_MASK, reader->accepted);
+            cmpxchg(&reader->cursor->tail, ev->seq, ev->seq + 1);
+        }
+    }
+    spin_unlock(&bdev->readers_lock);
+}
+
+/*
+ * Publish one record. The ring never
+ * blocks: the oldest record is overwritten and readers that fell a whole
+ * ring behind account for the loss themselves.
+ */
+static void ring_put(struct gpio_button_dev *bdev, struct gpio_button_event *ev)
+{
+    struct gpio_button_ring *ring = bdev->ring;
+    u32 head;
+
+    // The IRQ thread and the long press work both publish, the lock orders them
+    write_seqlock_bh(&bdev->ring_lock);
+    head = ring->head;
+    ev->seq = head;
+    ring->events[head & RING_MASK] = *ev;
+    // Pairs with the acquire of head by mmap readers
+    smp_store_release(&ring->head, head + 1);
+    // read() snapshots under ring_lock, so it never sees a stale filter bit
+    readers_filter(bdev, ev);
+    write_sequnlock_bh(&bdev->ring_lock);
+}
+
+// An accepted record is pending between tail and head
+static bool reader_has_events(struct gpio_button_reader *reader)
+{
+    u32 head = READ_ONCE(reader->bdev->ring->head);
+    u32 tail = READ_ONCE(reader->cursor->tail);
+
+    // Lost records and a bogus cursor are both sorted out by read()
+    if (head - tail > GPIO_BUTTON_RING_ENTRIES)
+        return true;
+
+    for (; tail != head; tail++) {
+        if (test_bit(tail & RING_MASK, reader->accepted))
+            return true;
+    }
+
+    return false;
+}
+
+// The reader fell a whole ring behind, records were overwritten unseen
+static bool reader_overrun(struct gpio_button_reader *reader)
+{
+    s32 behind = READ_ONCE(reader->bdev->ring->head) - READ_ONCE(reader->cursor->tail);
+
+    return behind > GPIO_BUTTON_RING_ENTRIES;
+}
+
+static __poll_t reader_poll_mask(struct gpio_button_reader *reader)
+{
+    if (!reader_has_events(reader))
+        return 0;
+
+    return EPOLLIN | EPOLLRDNORM | (reader_overrun(reader) ? EPOLLPRI : 0);
+}
+
+/*
+ * Keyed wakeup of one reader. Only poll entries interested in the mask are
+ * woken, and of the exclusive waiters (threads blocked in read(),
+ * EPOLLEXCLUSIVE epoll instances) only one.
+ */
+static void reader_wake(struct gpio_button_reader *reader)
+{
+    __poll_t mask = reader_poll_mask(reader);
+
+    if (mask && wq_has_sleeper(&reader->wait))
+        wake_up_poll(&reader->wait, mask);
+}
+
+// Readers that only consume through mmap never sleep and cost no wakeup
+static void readers_wake(struct gpio_button_dev *bdev)
+{
+    struct gpio_button_reader *reader;
+
+    spin_lock_bh(&bdev->readers_lock);
+    list_for_each_entry(reader, &bdev->readers, node)
+        reader_wake(reader);
+    spin_unlock_bh(&bdev->readers_lock);
+}
+
+// Publish a record and wake the readers waiting for it
+static void button_publish(struct gpio_button_dev *bdev, struct gpio_button_event *ev)
+{
+    ring_put(bdev, ev);
+    atomic_long_inc(&bdev->stats.events);
+    // Usually the press that woke the system, debounce window included
+    if (atomic_read(&bdev->resume_pending) && atomic_xchg(&bdev->resume_pending, 0)) {
+        atomic_long_set(&bdev->stats.resume_latency_us,
+                        ktime_us_delta(ktime_get(), bdev->resume_time));
+    }
+    trace_gpio_button_debounce(bdev->id, ev);
+}
+
+static void button_emit(struct gpio_button_dev *bdev, struct gpio_button_event *ev)
+{
+    button_publish(bdev, ev);
+
+    trace_gpio_button_wakeup(bdev->id, ev->seq);
+    readers_wake(bdev);
+}
+
+// Bitmask of the instances in bdev's chord group that are held right now
+static u32 chord_mask(struct gpio_button_dev *bdev)
+{
+    struct gpio_button_dev *other;
+    u32 group = READ_ONCE(bdev->chord_group);
+    u32 mask = 0;
+
+    spin_lock(&gpio_button_list_lock);
+    list_for_each_entry(other, &gpio_button_list, node) {
+        if (READ_ONCE(other->chord_group) == group && READ_ONCE(other->pressed))
+            mask |= BIT(other->id);
+    }
+    spin_unlock(&gpio_button_list_lock);
+
+    return mask;
+}
+
+// Gestures that follow from a state change just published in ev
+static void gesture_update(struct gpio_button_dev *bdev, const struct gpio_button_event *ev)
+{
+    struct gpio_button_event gev = {
+        .timestamp_ns = ev->timestamp_ns,
+        .value = ev->value,
+    };
+    u32 long_ms = READ_ONCE(bdev->long_press_ms);
+    u32 click_ms = READ_ONCE(bdev->double_click_ms);
+    u32 mask;
+
+    if (!ev->value) {
+        // A long press or the second click of a double never starts another
+        bdev->click_armed = click_ms && !bdev->click_second &&
+                            !(long_ms && ev->hold_us >= long_ms * USEC_PER_MSEC);
+        bdev->click_second = false;
+        bdev->release_time = bdev->edge_time;
+        return;
+    }
+
+    if (long_ms)
+        mod_delayed_work(system_highpri_wq, &bdev->long_press_work,
+                         msecs_to_jiffies(long_ms));
+
+    if (bdev->click_armed && click_ms &&
+        ktime_ms_delta(bdev->edge_time, bdev->release_time) <= click_ms) {
+        gev.type = GPIO_BUTTON_EV_DOUBLE_CLICK;
+        gev.duration_us = ktime_us_delta(ktime_get(), bdev->edge_time);
+        bdev->click_second = true;
+        button_emit(bdev, &gev);
+    }
+    bdev->click_armed = false;
+
+    if (READ_ONCE(bdev->chord_group)) {
+        mask = chord_mask(bdev);
+        if (hweight32(mask) > 1) {
+            gev.type = GPIO_BUTTON_EV_CHORD;
+            gev.value = mask;
+            gev.duration_us = ktime_us_delta(ktime_get(), bdev->edge_time);
+            button_emit(bdev, &gev);
+        }
+    }
+}
+
+// Fires long_press_ms after a press unless the release cancelled it first
+static void long_press_work_fn(struct work_struct *work)
+{
+    struct gpio_button_dev *bdev = container_of(to_delayed_work(work),
+                                                struct gpio_button_dev, long_press_work);
+    ktime_t now = ktime_get();
+    struct gpio_button_event ev = {
+        .timestamp_ns = ktime_to_ns(bdev->press_time),
+        .type = GPIO_BUTTON_EV_LONG_PRESS,
+        .duration_us = ktime_us_delta(now, bdev->press_time),
+        .value = 1,
+        .hold_us = ktime_us_delta(now, bdev->press_time),
+    };
+
+    if (READ_ONCE(bdev->pressed))
+        button_emit(bdev, &ev);
+}
+
+// Report a debounced state change, called from the IRQ thread only
+static void debounce_complete(struct gpio_button_dev *bdev, bool pressed)
+{
+    struct gpio_button_event ev = { 0 };
+
+    if (pressed == bdev->pressed)
+        return;  // Bounced back to where it was
+
+    bdev->pressed = pressed;
+
+    ev.timestamp_ns = ktime_to_ns(bdev->edge_time);
+    ev.type = pressed ? GPIO_BUTTON_EV_PRESS : GPIO_BUTTON_EV_RELEASE;
+    ev.duration_us = ktime_us_delta(ktime_get(), bdev->edge_time);
+    ev.value = pressed;
+
+    if (pressed) {
+        bdev->press_time = bdev->edge_time;
+    } else {
+        ev.hold_us = ktime_us_delta(bdev->edge_time, bdev->press_time);
+        // No long press may be reported after its release
+        cancel_delayed_work_sync(&bdev->long_press_work);
+    }
+
+    // Fast path: change the LED before any reader is woken
+    if (pressed && READ_ONCE(bdev->fast_toggle)) {
+        led_apply(bdev, GPIO_BUTTON_LED_TOGGLE);
+        ev.flags |= GPIO_BUTTON_EVF_LED_TOGGLED;
+    }
+
+    button_emit(bdev, &ev);
+    gesture_update(bdev, &ev);
+}
+
+/*
+ * Grouped mode: one bitmap record per change of any line. Gestures, chords
+ * and the LED fast path need a single button and do not apply here.
+ */
+static void group_complete(struct gpio_button_dev *bdev, u32 state)
+{
+    struct gpio_button_event ev = { 0 };
+
+    if (state == bdev->group_state)
+        return;  // Bounced back to where it was
+
+    bdev->group_state = state;
+
+    ev.timestamp_ns = ktime_to_ns(bdev->edge_time);
+    ev.type = GPIO_BUTTON_EV_GROUP;
+    ev.duration_us = ktime_us_delta(ktime_get(), bdev->edge_time);
+    ev.value = state;
+
+    button_emit(bdev, &ev);
+}
+
+/*
+ * Without diodes three keys on the corners of a rectangle make the fourth
+ * read as pressed too: two rows sharing more than one column is ambiguous.
+ */
+static bool matrix_ghosting(const u16 *raw, unsigned int rows)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < rows; i++) {
+        if (hweight16(raw[i]) < 2)
+            continue;
+        for (j = i + 1; j < rows; j++) {
+            if (hweight16(raw[i] & raw[j]) > 1)
+                return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * One scan of the whole matrix, from the hrtimer (softirq). A key changes
+ * state once it read the same new value for debounce_us worth of scans; all
+ * changes of a scan go out with one wakeup.
+ */
+static void matrix_scan(struct gpio_button_dev *bdev)
+{
+    struct gpio_button_matrix *m = bdev->matrix;
+    struct gpio_descs *rows = m->row_gpios, *cols = m->col_gpios;
+    struct gpio_button_event ev;
+    u16 raw[MATRIX_MAX_ROWS];
+    unsigned long values;
+    ktime_t now = ktime_get();
+    unsigned int r, c, key, need;
+    bool pressed, changed = false;
+    int ret;
+
+    for (r = 0; r < rows->ndescs; r++) {
+        gpiod_set_value(rows->desc[r], 1);
+        udelay(MATRIX_SETTLE_US);
+        values = 0;
+        ret = gpiod_get_array_value(cols->ndescs, cols->desc, cols->info, &values);
+        gpiod_set_value(rows->desc[r], 0);
+        if (ret < 0)
+            return;
+        raw[r] = values;
+    }
+
+    if (matrix_ghosting(raw, rows->ndescs)) {
+        atomic_long_inc(&bdev->stats.ghosts);
+        return;  // Keep the last good state until the ambiguity clears
+    }
+
+    need = clamp(DIV_ROUND_UP(READ_ONCE(bdev->debounce_us), READ_ONCE(m->scan_interval_us)),
+                 1U, (unsigned int)U8_MAX);
+
+    for (r = 0; r < rows->ndescs; r++) {
+        for (c = 0; c < cols->ndescs; c++) {
+            key = r * cols->ndescs + c;
+            pressed = raw[r] & BIT(c);
+
+            if (pressed == !!(m->key_state[r] & BIT(c))) {
+                m->key_count[key] = 0;
+                continue;
+            }
+            if (m->key_count[key]++ == 0)
+                m->key_change_time[key] = now;
+            if (m->key_count[key] < need)
+                continue;
+
+            m->key_count[key] = 0;
+            m->key_state[r] ^= BIT(c);
+
+            ev = (struct gpio_button_event) {
+                .timestamp_ns = ktime_to_ns(m->key_change_time[key]),
+                .type = pressed ? GPIO_BUTTON_EV_KEY_PRESS : GPIO_BUTTON_EV_KEY_RELEASE,
+                .duration_us = ktime_us_delta(now, m->key_change_time[key]),
+                .value = key,
+            };
+            if (pressed)
+                m->key_press_time[key] = m->key_change_time[key];
+            else
+                ev.hold_us = ktime_us_delta(m->key_change_time[key], m->key_press_time[key]);
+
+            button_publish(bdev, &ev);
+            changed = true;
+        }
+    }
+
+    if (changed) {
+        trace_gpio_button_wakeup(bdev->id, ev.seq);
+        readers_wake(bdev);
+    }
+}
+
+static enum hrtimer_restart matrix_scan_timer(struct hrtimer *timer)
+{
+    struct gpio_button_matrix *m = container_of(timer, struct gpio_button_matrix, scan_timer);
+
+    matrix_scan(m->bdev);
+    hrtimer_forward_now(timer, us_to_ktime(READ_ONCE(m->scan_interval_us)));
+
+    return HRTIMER_RESTART;
+}
+
+/*
+ * Hard IRQ handler: only timestamps the first edge of a debounce window. All
+ * GPIO access happens in the IRQ thread so sleeping GPIO controllers work.
+ * In grouped mode every line shares the window, so any number of edges cost
+ * one debounce sleep and one sample.
+ */
+static irqreturn_t button_isr(int irq, void *dev_id)
+{
+    struct gpio_button_dev *bdev = dev_id;
+
+    atomic_long_inc(&bdev->stats.irqs);
+
+    // Ignore interrupts during debounce period
+    if (atomic_cmpxchg(&bdev->debounce_active, 0, irq)) {
+        atomic_long_inc(&bdev->stats.debounce_rejects);
+        if (trace_gpio_button_irq_enabled())
+            trace_gpio_button_irq(bdev->id, ktime_get(), true);
+        return IRQ_HANDLED;
+    }
+
+    bdev->edge_time = ktime_get();
+    trace_gpio_button_irq(bdev->id, bdev->edge_time, false);
+
+    return IRQ_WAKE_THREAD;
+}
+
+static irqreturn_t button_irq_thread(int irq, void *dev_id)
+{
+    struct gpio_button_dev *bdev = dev_id;
+    int owner;
+    u32 us;
+
+    /*
+     * Nested (sleeping) irqchips never run the hard handler, so claim the
+     * window and timestamp here. In grouped mode another line may already
+     * own it; that edge is covered by the owner's sample, so reject it
+     * rather than emit a second record.
+     */
+    owner = atomic_cmpxchg(&bdev->debounce_active, 0, irq);
+    if (!owner) {
+        bdev->edge_time = ktime_get();
+        atomic_long_inc(&bdev->stats.irqs);
+        trace_gpio_button_irq(bdev->id, bdev->edge_time, false);
+    } else if (owner != irq) {
+        atomic_long_inc(&bdev->stats.irqs);
+        atomic_long_inc(&bdev->stats.debounce_rejects);
+        if (trace_gpio_button_irq_enabled())
+            trace_gpio_button_irq(bdev->id, ktime_get(), true);
+        return IRQ_HANDLED;
+    }
+
+    for (;;) {
+        // hrtimer backed sleep, keeps microsecond resolution of debounce_us
+        us = READ_ONCE(bdev->debounce_us);
+        usleep_range(us, us);
+
+        if (bdev->button_gpios)
+            group_complete(bdev, group_pressed(bdev));
+        else
+            debounce_complete(bdev, button_pressed(bdev));
+        atomic_set(&bdev->debounce_active, 0);  // Re-enable interrupts
+
+        /*
+         * An edge between the sample and re-enabling was dropped by the
+         * hard handler. If the line moved, debounce it here; if the hard
+         * handler already claimed it, the thread will be woken again.
+         */
+        if (button_sample(bdev) == button_state(bdev) ||
+            atomic_cmpxchg(&bdev->debounce_active, 0, irq))
+            break;
+
+        bdev->edge_time = ktime_get();
+    }
+
+    return IRQ_HANDLED;
+}
+
+/*
+ * Take a consistent copy of up to max records from the reader's cursor.
+ * Records the reader lost to overwriting are skipped and counted, records its
+ * filter rejected are skipped. Returns the number of records copied and the
+ * cursor value after the last record looked at in *next.
+ */
+static u32 ring_snapshot(struct gpio_button_reader *reader,
+                         struct gpio_button_event *buf, u32 max, u32 *next)
+{
+    struct gpio_button_dev *bdev = reader->bdev;
+    struct gpio_button_ring *ring = bdev->ring;
+    u32 head, tail, count, lost;
+    unsigned int seq;
+
+    do {
+        seq = read_seqbegin(&bdev->ring_lock);
+        head = READ_ONCE(ring->head);
+        tail = READ_ONCE(reader->cursor->tail);
+        lost = 0;
+
+        // The cursor page is writable from userspace, never trust it
+        if ((s32)(head - tail) < 0) {
+            tail = head;
+        } else if (head - tail > GPIO_BUTTON_RING_ENTRIES) {
+            lost = head - tail - GPIO_BUTTON_RING_ENTRIES;
+            tail = head - GPIO_BUTTON_RING_ENTRIES;
+        }
+
+        for (count = 0; tail != head && count < max; tail++) {
+            if (test_bit(tail & RING_MASK, reader->accepted))
+                buf[count++] = ring->events[tail & RING_MASK];
+        }
+    } while (read_seqretry(&bdev->ring_lock, seq));
+
+    if (lost) {
+        reader->cursor->lost += lost;
+        atomic_add(lost, &bdev->overflows);
+    }
+
+    *next = tail;
+    return count;
+}
+
+/*
+ * Histogram bucket n > 0 counts latencies in [2^(n-1), 2^n) us, bucket 0
+ * anything under 1 us. The latency runs from publishing the record
+ * (timestamp_ns + duration_us) to read() handing it over, so it shows wakeup
+ * and read latency without the debounce window, hold time or scan interval.
+ */
+static void record_latency(struct gpio_button_dev *bdev,
+                           const struct gpio_button_event *batch, u32 count)
+{
+    u64 now = ktime_get_ns();
+    u32 i;
+
+    for (i = 0; i < count; i++) {
+        u64 published = batch[i].timestamp_ns + (u64)batch[i].duration_us * NSEC_PER_USEC;
+        u64 us = now > published ? div_u64(now - published, NSEC_PER_USEC) : 0;
+
+        atomic_long_inc(&bdev->stats.latency[min(fls64(us), LATENCY_BUCKETS - 1)]);
+    }
+}
+
+static ssize_t gpio_button_read(struct file *file, char __user *buffer, size_t len, loff_t *offset)
+{
+    struct gpio_button_reader *reader = file->private_data;
+    struct gpio_button_event batch[READ_BATCH];
+    size_t esize = sizeof(batch[0]);
+    size_t copied = 0;
+    u32 count, next;
+    int ret;
+
+    if (len < esize)
+        return -EINVAL;
+
+    for (;;) {
+        if (!reader_has_events(reader)) {
+            // Records already published can still be read after removal
+            if (READ_ONCE(reader->bdev->dead))
+                return -ENODEV;
+            if (file->f_flags & O_NONBLOCK)
+                return -EAGAIN;
+
+            // Wait until there is at least one event (blocking)
+            ret = wait_event_interruptible_exclusive(reader->wait,
+                                                     reader_has_events(reader) ||
+                                                     READ_ONCE(reader->bdev->dead));
+            if (ret)
+                return -ERESTARTSYS; // Interrupted by signal
+            continue;
+        }
+
+        if (mutex_lock_interruptible(&reader->read_lock))
+            return -ERESTARTSYS;
+
+        // Drain as many whole records as fit in the buffer
+        ret = 0;
+        while (len - copied >= esize) {
+            count = ring_snapshot(reader, batch,
+                                  min_t(size_t, READ_BATCH, (len - copied) / esize),
+                                  &next);
+
+            if (count && copy_to_user(buffer + copied, batch, count * esize)) {
+                ret = -EFAULT;
+                break;
+            }
+
+            // Rejected records are consumed even when nothing was copied
+            WRITE_ONCE(reader->cursor->tail, next);
+            if (!count)
+                break;
+
+            copied += count * esize;
+            record_latency(reader->bdev, batch, count);
+            trace_gpio_button_read(reader->bdev->id, batch, count);
+        }
+
+        mutex_unlock(&reader->read_lock);
+
+        // Exclusive wakeups woke only us, hand what is left to the next waiter
+        reader_wake(reader);
+
+        if (copied)
+            return copied;
+        if (ret)
+            return ret;
+
+        // Another thread on this file may have consumed them first, wait again
+    }
+}
+
+// EPOLLPRI: this reader has lost records, cleared by the next read().
+// EPOLLHUP: the device was removed.
+static __poll_t gpio_button_poll(struct file *file, poll_table *wait)
+{
+    struct gpio_button_reader *reader = file->private_data;
+
+    poll_wait(file, &reader->wait, wait);
+    return reader_poll_mask(reader) | (READ_ONCE(reader->bdev->dead) ? EPOLLHUP : 0);
+}
+
+/*
+ * GPIO_BUTTON_OFF_RING maps the shared ring read-only, GPIO_BUTTON_OFF_CURSOR
+ * maps this reader's cursor so poll() knows how far it has consumed.
+ */
+static int gpio_button_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct gpio_button_reader *reader = file->private_data;
+
+    switch (vma->vm_pgoff << PAGE_SHIFT) {
+    case GPIO_BUTTON_OFF_RING:
+        if (vma->vm_flags & VM_WRITE)
+            return -EPERM;
+        vm_flags_clear(vma, VM_MAYWRITE);
+        return remap_vmalloc_range(vma, reader->bdev->ring, 0);
+    case GPIO_BUTTON_OFF_CURSOR:
+        return remap_vmalloc_range(vma, reader->cursor, 0);
+    default:
+        return -EINVAL;
+    }
+}
+
+static long gpio_button_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct gpio_button_reader *reader = file->private_data;
+    struct gpio_button_dev *bdev = reader->bdev;
+    struct gpio_button_filter filter;
+    struct gpio_button_led led;
+    int state;
+
+    switch (cmd) {
+    case GPIO_BUTTON_IOC_LED:
+        if (copy_from_user(&led, (void __user *)arg, sizeof(led)))
+            return -EFAULT;
+
+        state = led_apply(bdev, led.op);
+        if (state < 0)
+            return state;
+
+        led.value = state;
+        if (copy_to_user((void __user *)arg, &led, sizeof(led)))
+            return -EFAULT;
+
+        return 0;
+    case GPIO_BUTTON_IOC_FILTER:
+        if (copy_from_user(&filter, (void __user *)arg, sizeof(filter)))
+            return -EFAULT;
+
+        // The producer reads the filter under readers_lock
+        spin_lock_bh(&bdev->readers_lock);
+        reader->type_mask = filter.type_mask;
+        reader->rate_limit_ns = (u64)filter.rate_limit_ms * NSEC_PER_MSEC;
+        reader->last_accept_ns = 0;
+        spin_unlock_bh(&bdev->readers_lock);
+
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
+static void gpio_button_free(struct kref *kref)
+{
+    struct gpio_button_dev *bdev = container_of(kref, struct gpio_button_dev, kref);
+
+    vfree(bdev->ring);
+    put_device(bdev->dev);
+    kfree(bdev);
+}
+
+static void gpio_button_put(void *data)
+{
+    struct gpio_button_dev *bdev = data;
+
+    kref_put(&bdev->kref, gpio_button_free);
+}
+
+static int gpio_button_open(struct inode *inode, struct file *file)
+{
+    unsigned int minor = iminor(inode) - MINOR(dev_base);
+    struct gpio_button_dev *bdev;
+    struct gpio_button_reader *reader;
+    int ret;
+
+    reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+    if (!reader)
+        return -ENOMEM;
+
+    reader->cursor = vmalloc_user(PAGE_SIZE);
+    if (!reader->cursor) {
+        kfree(reader);
+        return -ENOMEM;
+    }
+
+    /*
+     * The cdev may still be reachable while gpio_remove() runs. Holding
+     * the lock across the runtime resume also keeps a racing open from
+     * restarting the matrix scan once remove has stopped it.
+     */
+    mutex_lock(&gpio_button_minors_lock);
+    bdev = minor < GPIO_BUTTON_MAX_DEVICES ? gpio_button_minors[minor] : NULL;
+    // Every open file keeps the instance active, see gpio_button_runtime_suspend()
+    ret = bdev ? pm_runtime_resume_and_get(bdev->dev) : -ENODEV;
+    if (!ret)
+        kref_get(&bdev->kref);
+    mutex_unlock(&gpio_button_minors_lock);
+    if (ret) {
+        vfree(reader->cursor);
+        kfree(reader);
+        return ret;
+    }
+
+    reader->bdev = bdev;
+    mutex_init(&reader->read_lock);
+    init_waitqueue_head(&reader->wait);
+    file->private_data = reader;
+
+    // New readers start at the current head and only see new events. Taken
+    // under readers_lock so the filter decides every record after it.
+    spin_lock_bh(&bdev->readers_lock);
+    reader->cursor->tail = READ_ONCE(bdev->ring->head);
+    list_add_tail(&reader->node, &bdev->readers);
+    spin_unlock_bh(&bdev->readers_lock);
+
+    return 0;
+}
+
+static int gpio_button_release(struct inode *inode, struct file *file)
+{
+    struct gpio_button_reader *reader = file->private_data;
+    struct gpio_button_dev *bdev = reader->bdev;
+    bool dead;
+
+    spin_lock_bh(&bdev->readers_lock);
+    list_del(&reader->node);
+    dead = bdev->dead;
+    spin_unlock_bh(&bdev->readers_lock);
+
+    vfree(reader->cursor);
+    kfree(reader);
+
+    // After gpio_remove() the reference was already dropped, see there
+    if (!dead) {
+        pm_runtime_mark_last_busy(bdev->dev);
+        pm_runtime_put_autosuspend(bdev->dev);
+    }
+    kref_put(&bdev->kref, gpio_button_free);
+
+    return 0;
+}
+
+static struct file_operations fops = {
+    .owner = THIS_MODULE,
+    .open = gpio_button_open,
+    .release = gpio_button_release,
+    .read = gpio_button_read,
+    .poll = gpio_button_poll,
+    .mmap = gpio_button_mmap,
+    .unlocked_ioctl = gpio_button_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+};
+
+// Sysfs attribute show function
+static ssize_t led_status_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct gpio_button_dev *bdev = dev_get_drvdata(dev);
+    int state = led_apply(bdev, GPIO_BUTTON_LED_GET);
+
+    if (state < 0)
+        return state;
+
+    return sprintf(buf, "%d\n", state);
+}
+
+// Accepts "0", "1" or "toggle"; the ioctl is the cheaper path for fast updates
+static ssize_t led_status_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct gpio_button_dev *bdev = dev_get_drvdata(dev);
+    u32 op;
+    int ret;
+
+    if (sysfs_streq(buf, "0"))
+        op = GPIO_BUTTON_LED_CLEAR;
+    else if (sysfs_streq(buf, "1"))
+        op = GPIO_BUTTON_LED_SET;
+    else if (sysfs_streq(buf, "toggle"))
+        op = GPIO_BUTTON_LED_TOGGLE;
+    else
+        return -EINVAL;
+
+    ret = led_apply(bdev, op);
+
+    return ret < 0 ? ret : count;
+}
+
+static DEVICE_ATTR(led_status, 0664, led_status_show, led_status_store);
+
+// Records readers lost because they fell a whole ring behind
+static ssize_t overflows_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct gpio_button_dev *bdev = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%d\n", atomic_read(&bdev->overflows));
+}
+
+static DEVICE_ATTR_RO(overflows);
+
+// Debounce window in microseconds, takes effect from the next press
+static ssize_t debounce_us_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct gpio_button_dev *bdev = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%u\n", READ_ONCE(bdev->debounce_us));
+}
+
+static ssize_t debounce_us_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct gpio_button_dev *bdev = dev_get_drvdata(dev);
+    u32 val;
+    int ret;
+
+    ret = kstrtou32(buf, 10, &val);
+    if (ret)
+        return ret;
+
+    if (val == 0 || val > MAX_DEBOUNCE_US)
+        return -EINVAL;
+
+    WRITE_ONCE(bdev->debounce_us, val);
+
+    return count;
+}
+
+static DEVICE_ATTR_RW(debounce_us);
+
+// 1: the driver toggles the LED itself on every debounced press
+static ssize_t fast_toggle_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct gpio_button_dev *bdev = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%d\n", READ_ONCE(bdev->fast_toggle));
+}
+
+static ssize_t fast_toggle_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct gpio_button_dev *bdev = dev_get_drvdata(dev);
+    bool val;
+    int ret;
+
+    ret = kstrtobool(buf, &val);
+    if (ret)
+        return ret;
+
+    WRITE_ONCE(bdev->fast_toggle, val);
+
+    return count;
+}
 
-static struct timer_list debounce_timer;
-static atomic_t debounce_active = ATOMIC_INIT(0);
+static DEVICE_ATTR_RW(fast_toggle);
 
-static struct gpio_desc *button_gpio;
-static struct gpio_desc *led_gpio;
-static int irq_number;
-static dev_t dev_num;
-static struct cdev c_dev;
-static struct class *cl;
-static DECLARE_WAIT_QUEUE_HEAD(button_wait);
-static atomic_t button_event_flag = ATOMIC_INIT(0);
-static volatile int led_status = 0;
+// PWM duty used while the LED is on, only present when the LED has a PWM
+static ssize_t brightness_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct gpio_button_dev *bdev = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%u\n", READ_ONCE(bdev->brightness));
+}
 
-static void debounce_timer_callback(struct timer_list *timer)
+static ssize_t brightness_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
 {
-    int button_state = gpiod_get_value(button_gpio);
-    
-    if (button_state == 0) {  // Assuming active-low button
-        atomic_set(&button_event_flag, 1);
-        wake_up(&button_wait);
+    struct gpio_button_dev *bdev = dev_get_drvdata(dev);
+    unsigned int val;
+    int ret;
+
+    ret = kstrtouint(buf, 10, &val);
+    if (ret)
+        return ret;
+
+    if (val > MAX_BRIGHTNESS)
+        return -EINVAL;
+
+    mutex_lock(&bdev->led_lock);
+    if (val != bdev->brightness) {
+        bdev->brightness = val;
+        led_update(bdev, true);
     }
-    
-    atomic_set(&debounce_active, 0);  // Re-enable interrupts
+    mutex_unlock(&bdev->led_lock);
+
+    return count;
 }
 
-static irqreturn_t button_isr(int irq, void *dev_id)
+static DEVICE_ATTR_RW(brightness);
+
+/*
+ * Blink half periods in milliseconds. With both set the LED blinks from the
+ * kernel while led_status is 1, 0 in either gives a steady LED again.
+ */
+#define GPIO_BUTTON_BLINK_ATTR(name)                                            \
+static ssize_t name##_show(struct device *dev, struct device_attribute *attr, char *buf) \
+{                                                                               \
+    struct gpio_button_dev *bdev = dev_get_drvdata(dev);                        \
+                                                                                \
+    return sprintf(buf, "%u\n", READ_ONCE(bdev->name));                         \
+}                                                                               \
+                                                                                \
+static ssize_t name##_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) \
+{                                                                               \
+    struct gpio_button_dev *bdev = dev_get_drvdata(dev);                        \
+    u32 val;                                                                    \
+    int ret;                                                                    \
+                                                                                \
+    ret = kstrtou32(buf, 10, &val);                                             \
+    if (ret)                                                                    \
+        return ret;                                                             \
+                                                                                \
+    if (val > MAX_BLINK_MS)                                                     \
+        return -EINVAL;                                                         \
+                                                                                \
+    mutex_lock(&bdev->led_lock);                                                \
+    if (val != bdev->name) {                                                    \
+        bdev->name = val;                                                       \
+        led_blink_restart(bdev);                                                \
+        led_update(bdev, false);                                                \
+    }                                                                           \
+    mutex_unlock(&bdev->led_lock);                                              \
+                                                                                \
+    return count;                                                               \
+}                                                                               \
+static DEVICE_ATTR_RW(name)
+
+GPIO_BUTTON_BLINK_ATTR(blink_on_ms);
+GPIO_BUTTON_BLINK_ATTR(blink_off_ms);
+
+// Matrix scan period in microseconds, only present in matrix mode
+static ssize_t scan_interval_us_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-    // Ignore interrupts during debounce period
-    if (atomic_read(&debounce_active))
-        return IRQ_HANDLED;
-    
-    // Start debounce timer
-    atomic_set(&debounce_active, 1);
-    mod_timer(&debounce_timer, jiffies + msecs_to_jiffies(50));  // 50ms debounce
-    
-    return IRQ_HANDLED;
+    struct gpio_button_dev *bdev = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%u\n", READ_ONCE(bdev->matrix->scan_interval_us));
 }
 
-static ssize_t gpio_button_read(struct file *file, char __user *buffer, size_t len, loff_t *offset)
+static ssize_t scan_interval_us_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
 {
-    char event_char;
+    struct gpio_button_dev *bdev = dev_get_drvdata(dev);
+    u32 val;
     int ret;
 
-    // Wait until the event flag is set (blocking)
-    ret = wait_event_interruptible(button_wait, atomic_read(&button_event_flag));
-    if (ret) {
-        return -ERESTARTSYS; // Interrupted by signal
+    ret = kstrtou32(buf, 10, &val);
+    if (ret)
+        return ret;
+
+    if (val < MIN_SCAN_INTERVAL_US || val > MAX_DEBOUNCE_US)
+        return -EINVAL;
+
+    // Picked up when the timer next rearms
+    WRITE_ONCE(bdev->matrix->scan_interval_us, val);
+
+    return count;
+}
+
+static DEVICE_ATTR_RW(scan_interval_us);
+
+// Gesture thresholds in milliseconds, 0 turns the gesture off
+#define GPIO_BUTTON_GESTURE_ATTR(name, max)                                     \
+static ssize_t name##_show(struct device *dev, struct device_attribute *attr, char *buf) \
+{                                                                               \
+    struct gpio_button_dev *bdev = dev_get_drvdata(dev);                        \
+                                                                                \
+    return sprintf(buf, "%u\n", READ_ONCE(bdev->name));                         \
+}                                                                               \
+                                                                                \
+static ssize_t name##_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) \
+{                                                                               \
+    struct gpio_button_dev *bdev = dev_get_drvdata(dev);                        \
+    u32 val;                                                                    \
+    int ret;                                                                    \
+                                                                                \
+    ret = kstrtou32(buf, 10, &val);                                             \
+    if (ret)                                                                    \
+        return ret;                                                             \
+                                                                                \
+    if (val > (max))                                                            \
+        return -EINVAL;                                                         \
+                                                                                \
+    WRITE_ONCE(bdev->name, val);                                                \
+                                                                                \
+    return count;                                                               \
+}                                                                               \
+static DEVICE_ATTR_RW(name)
+
+GPIO_BUTTON_GESTURE_ATTR(long_press_ms, MAX_GESTURE_MS);
+GPIO_BUTTON_GESTURE_ATTR(double_click_ms, MAX_GESTURE_MS);
+// Instances sharing a non-zero group report a CHORD when held together
+GPIO_BUTTON_GESTURE_ATTR(chord_group, U32_MAX);
+
+static struct attribute *gpio_button_attrs[] = {
+    &dev_attr_led_status.attr,
+    &dev_attr_overflows.attr,
+    &dev_attr_debounce_us.attr,
+    &dev_attr_fast_toggle.attr,
+    &dev_attr_brightness.attr,
+    &dev_attr_blink_on_ms.attr,
+    &dev_attr_blink_off_ms.attr,
+    &dev_attr_long_press_ms.attr,
+    &dev_attr_double_click_ms.attr,
+    &dev_attr_chord_group.attr,
+    &dev_attr_scan_interval_us.attr,
+    NULL,
+};
+
+static umode_t gpio_button_attr_visible(struct kobject *kobj, struct attribute *attr, int n)
+{
+    struct gpio_button_dev *bdev = dev_get_drvdata(kobj_to_dev(kobj));
+
+    if (attr == &dev_attr_brightness.attr && !bdev->pwm)
+        return 0;
+    if (attr == &dev_attr_scan_interval_us.attr && !bdev->matrix)
+        return 0;
+
+    return attr->mode;
+}
+
+static const struct attribute_group gpio_button_group = {
+    .attrs = gpio_button_attrs,
+    .is_visible = gpio_button_attr_visible,
+};
+
+#define GPIO_BUTTON_STAT_ATTR(name)                                             \
+static ssize_t name##_show(struct device *dev, struct device_attribute *attr, char *buf) \
+{                                                                               \
+    struct gpio_button_dev *bdev = dev_get_drvdata(dev);                        \
+                                                                                \
+    return sprintf(buf, "%ld\n", atomic_long_read(&bdev->stats.name));          \
+}                                                                               \
+static DEVICE_ATTR_RO(name)
+
+GPIO_BUTTON_STAT_ATTR(irqs);
+GPIO_BUTTON_STAT_ATTR(debounce_rejects);
+GPIO_BUTTON_STAT_ATTR(events);
+GPIO_BUTTON_STAT_ATTR(ghosts);
+GPIO_BUTTON_STAT_ATTR(resumes);
+GPIO_BUTTON_STAT_ATTR(resume_latency_us);
+
+// Same counter as overflows, kept here so the stats directory is complete
+static ssize_t dropped_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct gpio_button_dev *bdev = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%d\n", atomic_read(&bdev->overflows));
+}
+
+static DEVICE_ATTR_RO(dropped);
+
+/*
+ * One "<lower bound us> <count>" line per log2 bucket: records whose
+ * publish-to-read() latency was at least that many microseconds and less
+ * than the next line's bound. See record_latency().
+ */
+static ssize_t latency_hist_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct gpio_button_dev *bdev = dev_get_drvdata(dev);
+    int len = 0;
+    int i;
+
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        len += sysfs_emit_at(buf, len, "%lu %ld\n", i ? 1UL << (i - 1) : 0,
+                             atomic_long_read(&bdev->stats.latency[i]));
+    }
+
+    return len;
+}
+
+static DEVICE_ATTR_RO(latency_hist);
+
+// Any write clears every counter, including overflows
+static ssize_t reset_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct gpio_button_dev *bdev = dev_get_drvdata(dev);
+    int i;
+
+    atomic_long_set(&bdev->stats.irqs, 0);
+    atomic_long_set(&bdev->stats.debounce_rejects, 0);
+    atomic_long_set(&bdev->stats.events, 0);
+    atomic_long_set(&bdev->stats.ghosts, 0);
+    atomic_long_set(&bdev->stats.resumes, 0);
+    atomic_long_set(&bdev->stats.resume_latency_us, 0);
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+        atomic_long_set(&bdev->stats.latency[i], 0);
+    atomic_set(&bdev->overflows, 0);
+
+    return count;
+}
+
+static DEVICE_ATTR_WO(reset);
+
+static struct attribute *gpio_button_stats_attrs[] = {
+    &dev_attr_irqs.attr,
+    &dev_attr_debounce_rejects.attr,
+    &dev_attr_events.attr,
+    &dev_attr_ghosts.attr,
+    &dev_attr_resumes.attr,
+    &dev_attr_resume_latency_us.attr,
+    &dev_attr_dropped.attr,
+    &dev_attr_latency_hist.attr,
+    &dev_attr_reset.attr,
+    NULL,
+};
+
+static const struct attribute_group gpio_button_stats_group = {
+    .name = "stats",
+    .attrs = gpio_button_stats_attrs,
+};
+
+static const struct attribute_group *gpio_button_groups[] = {
+    &gpio_button_group,
+    &gpio_button_stats_group,
+    NULL,
+};
+
+/*
+ * LED class view of the button LED. A brightness write gives a steady LED
+ * like on any LED class device, so it also ends a blink_set() or sysfs
+ * blink. Changes from the other paths show up through brightness_get.
+ */
+static int led_cdev_brightness_set(struct led_classdev *cdev, enum led_brightness value)
+{
+    struct gpio_button_dev *bdev = container_of(cdev, struct gpio_button_dev, led_cdev);
+    bool force = false;
+
+    mutex_lock(&bdev->led_lock);
+
+    bdev->blink_on_ms = 0;
+    bdev->blink_off_ms = 0;
+    bdev->led_status = value != LED_OFF;
+    if (bdev->pwm && value != LED_OFF && value != bdev->brightness) {
+        bdev->brightness = value;
+        force = true;
     }
+    led_blink_restart(bdev);
+    led_update(bdev, force);
 
-    // Event occurred, translate it to ASCII
-    event_char = '1';
+    mutex_unlock(&bdev->led_lock);
 
-    // Clear the event flag
-    atomic_set(&button_event_flag, 0);
+    return 0;
+}
+
+static enum led_brightness led_cdev_brightness_get(struct led_classdev *cdev)
+{
+    struct gpio_button_dev *bdev = container_of(cdev, struct gpio_button_dev, led_cdev);
 
-    // Copy the ASCII character to userspace
-    if (copy_to_user(buffer, &event_char, sizeof(event_char)))
-        return -EFAULT;
+    if (!READ_ONCE(bdev->led_status))
+        return LED_OFF;
 
-    return sizeof(event_char);
+    return bdev->pwm ? READ_ONCE(bdev->brightness) : 1;
 }
 
-static unsigned int gpio_button_poll(struct file *file, poll_table *wait)
+// The timer trigger lands here and blinks on blink_work, no software timer
+static int led_cdev_blink_set(struct led_classdev *cdev, unsigned long *delay_on,
+                              unsigned long *delay_off)
 {
-    poll_wait(file, &button_wait, wait);
-    return atomic_read(&button_event_flag) ? POLLIN : 0;
+    struct gpio_button_dev *bdev = container_of(cdev, struct gpio_button_dev, led_cdev);
+
+    if (!*delay_on && !*delay_off) {
+        *delay_on = DEFAULT_BLINK_MS;
+        *delay_off = DEFAULT_BLINK_MS;
+    }
+    // Anything else falls back to the LED core's software blink
+    if (!*delay_on || !*delay_off || *delay_on > MAX_BLINK_MS || *delay_off > MAX_BLINK_MS)
+        return -EINVAL;
+
+    mutex_lock(&bdev->led_lock);
+    bdev->blink_on_ms = *delay_on;
+    bdev->blink_off_ms = *delay_off;
+    bdev->led_status = 1;
+    led_blink_restart(bdev);
+    led_update(bdev, false);
+    mutex_unlock(&bdev->led_lock);
+
+    return 0;
 }
 
-static int gpio_button_open(struct inode *inode, struct file *file)
+static int aux_led_brightness_set(struct led_classdev *cdev, enum led_brightness value)
 {
+    struct gpio_button_aux_led *led = container_of(cdev, struct gpio_button_aux_led, cdev);
+
+    gpiod_set_value_cansleep(led->gpio, value != LED_OFF);
+
     return 0;
 }
 
-static struct file_operations fops = {
-    .owner = THIS_MODULE,
-    .open = gpio_button_open,
-    .read = gpio_button_read,
-    .poll = gpio_button_poll,
-};
+static void led_cancel_blink(void *data)
+{
+    struct gpio_button_dev *bdev = data;
 
-// Sysfs attribute show function
-static ssize_t led_status_show(struct device *dev, struct device_attribute *attr, char *buf)
+    cancel_delayed_work_sync(&bdev->blink_work);
+}
+
+// "<sysfs name minus _sysfs>::<function>", e.g. gpio_button1::status
+static const char *led_cdev_name(struct device *dev, struct gpio_button_dev *bdev,
+                                 const char *function)
 {
-    return sprintf(buf, "%d\n", led_status);
+    if (bdev->id == 0)
+        return devm_kasprintf(dev, GFP_KERNEL, "%s::%s", DRIVER_NAME, function);
+
+    return devm_kasprintf(dev, GFP_KERNEL, "%s%d::%s", DRIVER_NAME, bdev->id, function);
 }
 
-static ssize_t led_status_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+/*
+ * Register the button LED and any aux-led-gpios with the LED class. The
+ * optional DT "linux,default-trigger" (button LED) and
+ * "aux-led-default-triggers" (one string per aux line) pick the triggers.
+ * Unregistered by devm after gpio_remove().
+ */
+static int leds_register(struct device *dev, struct gpio_button_dev *bdev)
 {
-    unsigned long val;
-    char local_buf[16]; // Buffer to hold the input string
+    const char *triggers[MAX_AUX_LEDS] = { NULL };
+    struct gpio_button_aux_led *led;
+    const char *function;
+    unsigned int i;
     int ret;
 
-    // Ensure the buffer is null-terminated and within size limits
-    if (count >= sizeof(local_buf)) {
-        pr_err("gpio_button: Input is too long (%zu bytes)\n", count);
+    // Runs after the LED class devices are gone, their last write may queue it
+    ret = devm_add_action_or_reset(dev, led_cancel_blink, bdev);
+    if (ret)
+        return ret;
+
+    if (bdev->led_gpio || bdev->pwm) {
+        bdev->led_cdev.name = led_cdev_name(dev, bdev, "status");
+        if (!bdev->led_cdev.name)
+            return -ENOMEM;
+        bdev->led_cdev.max_brightness = bdev->pwm ? MAX_BRIGHTNESS : 1;
+        bdev->led_cdev.brightness_set_blocking = led_cdev_brightness_set;
+        bdev->led_cdev.brightness_get = led_cdev_brightness_get;
+        bdev->led_cdev.blink_set = led_cdev_blink_set;
+        device_property_read_string(dev, "linux,default-trigger",
+                                    &bdev->led_cdev.default_trigger);
+
+        ret = devm_led_classdev_register(dev, &bdev->led_cdev);
+        if (ret) {
+            dev_err(dev, "Failed to register LED class device: %d\n", ret);
+            return ret;
+        }
+    }
+
+    bdev->aux_led_gpios = devm_gpiod_get_array_optional(dev, "aux-led", GPIOD_OUT_LOW);
+    if (IS_ERR(bdev->aux_led_gpios)) {
+        ret = PTR_ERR(bdev->aux_led_gpios);
+        dev_err(dev, "Failed to get AUX LED GPIOs: %d\n", ret);
+        return ret;
+    }
+    if (!bdev->aux_led_gpios)
+        return 0;
+    if (bdev->aux_led_gpios->ndescs > MAX_AUX_LEDS) {
+        dev_err(dev, "At most %d aux-led-gpios\n", MAX_AUX_LEDS);
         return -EINVAL;
     }
 
-    // Copy the input to a local buffer and null-terminate it
-    memcpy(local_buf, buf, count);
-    local_buf[count] = '\0';
+    bdev->aux_leds = devm_kcalloc(dev, bdev->aux_led_gpios->ndescs, sizeof(*bdev->aux_leds),
+                                  GFP_KERNEL);
+    if (!bdev->aux_leds)
+        return -ENOMEM;
+
+    device_property_read_string_array(dev, "aux-led-default-triggers", triggers,
+                                      bdev->aux_led_gpios->ndescs);
 
-    // Remove any trailing newline character
-    if (local_buf[count - 1] == '\n') {
-        local_buf[count - 1] = '\0';
+    for (i = 0; i < bdev->aux_led_gpios->ndescs; i++) {
+        led = &bdev->aux_leds[i];
+        led->gpio = bdev->aux_led_gpios->desc[i];
+        function = devm_kasprintf(dev, GFP_KERNEL, "aux%u", i);
+        led->cdev.name = function ? led_cdev_name(dev, bdev, function) : NULL;
+        if (!led->cdev.name)
+            return -ENOMEM;
+        led->cdev.max_brightness = 1;
+        led->cdev.brightness_set_blocking = aux_led_brightness_set;
+        led->cdev.default_trigger = triggers[i];
+
+        ret = devm_led_classdev_register(dev, &led->cdev);
+        if (ret) {
+            dev_err(dev, "Failed to register AUX LED %u: %d\n", i, ret);
+            return ret;
+        }
     }
 
-    // Debugging: Print the processed input string
-    pr_info("gpio_button: Processed input: '%s'\n", local_buf);
+    pr_info("gpio_button: %s():%d: %u AUX LEDs registered\n",
+            __func__, __LINE__, bdev->aux_led_gpios->ndescs);
 
-    // Convert the string to an integer
-    ret = kstrtoul(local_buf, 10, &val);
-    if (ret) {
-        pr_err("gpio_button: Failed to convert input to integer, ret = %d\n", ret);
+    return 0;
+}
+
+// Wait for running IRQ threads, the IRQs themselves are devm managed
+static void buttons_disable_irq(struct gpio_button_dev *bdev)
+{
+    unsigned int i;
+
+    for (i = 0; i < bdev->num_irqs; i++)
+        disable_irq(bdev->irqs[i]);
+}
+
+static void buttons_enable_irq(struct gpio_button_dev *bdev)
+{
+    unsigned int i;
+
+    for (i = 0; i < bdev->num_irqs; i++)
+        enable_irq(bdev->irqs[i]);
+}
+
+// Matrix mode setup, the scan timer is started by runtime resume
+static int matrix_probe(struct device *dev, struct gpio_button_dev *bdev)
+{
+    struct gpio_button_matrix *m;
+    unsigned int i;
+    int ret;
+
+    m = devm_kzalloc(dev, sizeof(*m), GFP_KERNEL);
+    if (!m)
+        return -ENOMEM;
+    m->bdev = bdev;
+
+    /*
+     * Open-drain rows: an unselected row floats instead of being driven, so
+     * two keys pressed in one column cannot short the selected row to it.
+     * gpiolib emulates open drain on controllers without it.
+     */
+    m->row_gpios = devm_gpiod_get_array(dev, "row", GPIOD_OUT_LOW_OPEN_DRAIN);
+    if (IS_ERR(m->row_gpios)) {
+        ret = PTR_ERR(m->row_gpios);
+        dev_err(dev, "Failed to get ROW GPIOs: %d\n", ret);
         return ret;
     }
-
-    // Validate the input (must be 0 or 1)
-    if (val != 0 && val != 1) {
-        pr_err("gpio_button: Input value must be 0 or 1, got %lu\n", val);
+    m->col_gpios = devm_gpiod_get_array(dev, "col", GPIOD_IN);
+    if (IS_ERR(m->col_gpios)) {
+        ret = PTR_ERR(m->col_gpios);
+        dev_err(dev, "Failed to get COL GPIOs: %d\n", ret);
+        return ret;
+    }
+    if (m->row_gpios->ndescs > MATRIX_MAX_ROWS || m->col_gpios->ndescs > MATRIX_MAX_COLS) {
+        dev_err(dev, "At most %ux%u matrix keys\n", MATRIX_MAX_ROWS, MATRIX_MAX_COLS);
         return -EINVAL;
     }
 
-    // Set the LED status
-    led_status = val;
-    gpiod_set_value(led_gpio, led_status);
+    // The scan runs in softirq context, sleeping GPIO controllers cannot be used
+    for (i = 0; i < m->row_gpios->ndescs; i++) {
+        if (gpiod_cansleep(m->row_gpios->desc[i]))
+            goto err_sleep;
+    }
+    for (i = 0; i < m->col_gpios->ndescs; i++) {
+        if (gpiod_cansleep(m->col_gpios->desc[i]))
+            goto err_sleep;
+    }
+
+    m->scan_interval_us = DEFAULT_SCAN_INTERVAL_US;
+    device_property_read_u32(dev, "scan-interval-us", &m->scan_interval_us);
+    if (m->scan_interval_us < MIN_SCAN_INTERVAL_US || m->scan_interval_us > MAX_DEBOUNCE_US) {
+        dev_warn(dev, "Invalid scan-interval-us %u, using %u\n",
+                 m->scan_interval_us, DEFAULT_SCAN_INTERVAL_US);
+        m->scan_interval_us = DEFAULT_SCAN_INTERVAL_US;
+    }
 
-    pr_info("gpio_button: LED status set to %lu\n", val);
+    // Soft expiry: the scan publishes under the _bh ring and reader locks
+    hrtimer_init(&m->scan_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    m->scan_timer.function = matrix_scan_timer;
 
-    return count;
-}
+    bdev->matrix = m;
+    pr_info("gpio_button: %s():%d: Matrix acquired: %ux%u keys\n",
+            __func__, __LINE__, m->row_gpios->ndescs, m->col_gpios->ndescs);
 
-static DEVICE_ATTR(led_status, 0664, led_status_show, led_status_store);
+    return 0;
+
+err_sleep:
+    dev_err(dev, "Matrix GPIOs must not sleep\n");
+    return -EINVAL;
+}
 
-static struct device *sysfs_dev; // Device for sysfs attribute
+static int gpio_button_runtime_resume(struct device *dev);
 
 static int gpio_probe(struct platform_device *pdev)
 {
     struct device *dev = &pdev->dev;
+    struct gpio_button_dev *bdev;
+    struct gpio_desc *desc;
+    unsigned int i;
+    int irq;
     int ret = 0;
 
     pr_info("gpio_button: %s():%d: Probe started\n",
             __func__, __LINE__);
 
-    // Get GPIO descriptors from device tree
-    button_gpio = gpiod_get(dev, "button", GPIOD_IN);
-    if (IS_ERR(button_gpio)) {
-        dev_err(dev, "Failed to get BUTTON GPIO: %ld\n", PTR_ERR(button_gpio));
-        pr_err("gpio_button: %s():%d: Button GPIO error, code: %d\n",
-                __func__, __LINE__, PTR_ERR(button_gpio));
-        return PTR_ERR(button_gpio);
-    }
-    pr_info("gpio_button: %s():%d: Button GPIO acquired: %d\n",
-            __func__, __LINE__, desc_to_gpio(button_gpio));
-
-    led_gpio = gpiod_get(dev, "led", GPIOD_OUT_LOW);
-    if (IS_ERR(led_gpio)) {
-        dev_err(dev, "Failed to get LED GPIO: %ld\n", PTR_ERR(led_gpio));
-        pr_err("gpio_button: %s():%d: LED GPIO error, code: $ld\n",
-               __func__, __LINE__, PTR_ERR(led_gpio));
-        ret = PTR_ERR(led_gpio);
-        goto err_led;
-    }
-    pr_info("gpio_button: %s():%d: LED GPIO acquired: %d\n",
-            __func__, __LINE__, desc_to_gpio(led_gpio));
-
-    // Setup interrupt
-    irq_number = gpiod_to_irq(button_gpio);
-    if (irq_number < 0) {
-        dev_err(dev, "Failed to get IRQ: %d\n", irq_number);
-        pr_err("gpio_button: %s():%d: IRQ error, code: %d\n",
-               __func__, __LINE__, irq_number);
-        ret = irq_number;
-        goto err_irq;
+    // Not devm: open files keep it, the probe reference is dropped by devm last
+    bdev = kzalloc(sizeof(*bdev), GFP_KERNEL);
+    if (!bdev)
+        return -ENOMEM;
+    kref_init(&bdev->kref);
+    bdev->dev = get_device(dev);
+
+    ret = devm_add_action_or_reset(dev, gpio_button_put, bdev);
+    if (ret)
+        return ret;
+
+    // Before anything that can reach the PM callbacks
+    platform_set_drvdata(pdev, bdev);
+
+    // Zeroed and page aligned so it can be mapped into userspace, freed with bdev
+    bdev->ring = vmalloc_user(GPIO_BUTTON_RING_SIZE);
+    if (!bdev->ring)
+        return -ENOMEM;
+    bdev->ring->entries = GPIO_BUTTON_RING_ENTRIES;
+
+    atomic_set(&bdev->debounce_active, 0);
+    atomic_set(&bdev->overflows, 0);
+    atomic_set(&bdev->resume_pending, 0);
+    seqlock_init(&bdev->ring_lock);
+    mutex_init(&bdev->led_lock);
+    bdev->led_hw = -1;
+    INIT_DELAYED_WORK(&bdev->blink_work, led_blink_work_fn);
+    INIT_LIST_HEAD(&bdev->readers);
+    spin_lock_init(&bdev->readers_lock);
+    // Debounce window in microseconds, settable per node in the DT
+    bdev->debounce_us = DEFAULT_DEBOUNCE_US;
+    device_property_read_u32(dev, "debounce-us", &bdev->debounce_us);
+    if (bdev->debounce_us == 0 || bdev->debounce_us > MAX_DEBOUNCE_US) {
+        dev_warn(dev, "Invalid debounce-us %u, using %u\n",
+                 bdev->debounce_us, DEFAULT_DEBOUNCE_US);
+        bdev->debounce_us = DEFAULT_DEBOUNCE_US;
     }
-    pr_info("gpio_button: %s():%d: IRQ number: %d\n",
-            __func__, __LINE__, irq_number);
 
-    ret = request_irq(irq_number, button_isr, IRQF_TRIGGER_FALLING, DRIVER_NAME, NULL);
-    if (ret) {
-        dev_err(dev, "Failed to request IRQ %d\n", irq_number);
-        pr_err("GPIO Driver: IRQ Request Error! Code: %d\n", ret);
-        goto err_irq;
+    bdev->fast_toggle = device_property_read_bool(dev, "toggle-led-on-press");
+
+    // Gestures stay off unless the node asks for them
+    device_property_read_u32(dev, "long-press-ms", &bdev->long_press_ms);
+    device_property_read_u32(dev, "double-click-ms", &bdev->double_click_ms);
+    device_property_read_u32(dev, "chord-group", &bdev->chord_group);
+    if (bdev->long_press_ms > MAX_GESTURE_MS || bdev->double_click_ms > MAX_GESTURE_MS) {
+        dev_warn(dev, "Gesture thresholds above %u ms, gestures disabled\n",
+                 MAX_GESTURE_MS);
+        bdev->long_press_ms = 0;
+        bdev->double_click_ms = 0;
+    }
+    INIT_DELAYED_WORK(&bdev->long_press_work, long_press_work_fn);
+
+    // Get GPIO descriptors from device tree: a keypad matrix, a group of
+    // button-gpios or a single button
+    if (device_property_present(dev, "row-gpios")) {
+        ret = matrix_probe(dev, bdev);
+        if (ret)
+            return ret;
+    } else if (gpiod_count(dev, "button") > 1) {
+        bdev->button_gpios = devm_gpiod_get_array(dev, "button", GPIOD_IN);
+        if (IS_ERR(bdev->button_gpios)) {
+            ret = PTR_ERR(bdev->button_gpios);
+            dev_err(dev, "Failed to get BUTTON GPIOs: %d\n", ret);
+            return ret;
+        }
+        if (bdev->button_gpios->ndescs > GPIO_BUTTON_MAX_LINES) {
+            dev_err(dev, "At most %d button-gpios per group\n", GPIO_BUTTON_MAX_LINES);
+            return -EINVAL;
+        }
+        pr_info("gpio_button: %s():%d: Button group acquired: %u GPIOs\n",
+                __func__, __LINE__, bdev->button_gpios->ndescs);
+    } else {
+        bdev->button_gpio = devm_gpiod_get(dev, "button", GPIOD_IN);
+        if (IS_ERR(bdev->button_gpio)) {
+            ret = PTR_ERR(bdev->button_gpio);
+            dev_err(dev, "Failed to get BUTTON GPIO: %d\n", ret);
+            return ret;
+        }
+        pr_info("gpio_button: %s():%d: Button GPIO acquired: %d\n",
+                __func__, __LINE__, desc_to_gpio(bdev->button_gpio));
+    }
+
+    // A PWM capable LED may be wired to the PWM only, then led-gpios is optional
+    if (device_property_present(dev, "pwms")) {
+        bdev->pwm = devm_pwm_get(dev, NULL);
+        if (IS_ERR(bdev->pwm)) {
+            ret = PTR_ERR(bdev->pwm);
+            dev_err(dev, "Failed to get LED PWM: %d\n", ret);
+            return ret;
+        }
+        bdev->brightness = MAX_BRIGHTNESS;
+        led_update(bdev, true);
+        pr_info("gpio_button: %s():%d: LED PWM acquired\n",
+                __func__, __LINE__);
+
+        bdev->led_gpio = devm_gpiod_get_optional(dev, "led", GPIOD_OUT_LOW);
+    } else if (bdev->matrix) {
+        // A keypad need not have an indicator LED
+        bdev->led_gpio = devm_gpiod_get_optional(dev, "led", GPIOD_OUT_LOW);
+    } else {
+        bdev->led_gpio = devm_gpiod_get(dev, "led", GPIOD_OUT_LOW);
+    }
+    if (IS_ERR(bdev->led_gpio)) {
+        ret = PTR_ERR(bdev->led_gpio);
+        dev_err(dev, "Failed to get LED GPIO: %d\n", ret);
+        return ret;
+    }
+    if (bdev->led_gpio) {
+        pr_info("gpio_button: %s():%d: LED GPIO acquired: %d\n",
+                __func__, __LINE__, desc_to_gpio(bdev->led_gpio));
+    }
+
+    // Both edges so presses and releases (and hold time) are reported
+    if (bdev->button_gpios)
+        bdev->group_state = group_pressed(bdev);
+    else if (!bdev->matrix)
+        bdev->pressed = button_pressed(bdev);
+
+    // Setup interrupts, one per button line sharing this instance's debounce.
+    // A matrix is polled and takes none.
+    for (i = 0; !bdev->matrix && i < (bdev->button_gpios ? bdev->button_gpios->ndescs : 1); i++) {
+        desc = bdev->button_gpios ? bdev->button_gpios->desc[i] : bdev->button_gpio;
+        irq = gpiod_to_irq(desc);
+        if (irq < 0) {
+            ret = irq;
+            dev_err(dev, "Failed to get IRQ: %d\n", ret);
+            goto err_irq;
+        }
+        pr_info("gpio_button: %s():%d: IRQ number: %d\n",
+                __func__, __LINE__, irq);
+
+        ret = devm_request_threaded_irq(dev, irq, button_isr, button_irq_thread,
+                                        IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING,
+                                        dev_name(dev), bdev);
+        if (ret) {
+            dev_err(dev, "Failed to request IRQ %d: %d\n", irq, ret);
+            goto err_irq;
+        }
+        bdev->irqs[bdev->num_irqs++] = irq;
     }
     pr_info("gpio_button: %s():%d: IRQ registered successfully\n",
             __func__, __LINE__);
 
-    // Create character device
-    if (alloc_chrdev_region(&dev_num, 0, 1, DRIVER_NAME)) {
-        ret = -ENODEV;
-        pr_err("gpio_button: %s():%d: Failed to allocate chrdev region\n",
-               __func__, __LINE__);
-        goto err_alloc;
+    // DT "wakeup-source": a press wakes the system. A matrix has no IRQ to wake on.
+    if (bdev->num_irqs)
+        device_init_wakeup(dev, device_property_read_bool(dev, "wakeup-source"));
+
+    // Starts suspended, the first open resumes it
+    pm_runtime_set_autosuspend_delay(dev, AUTOSUSPEND_DELAY_MS);
+    pm_runtime_use_autosuspend(dev);
+    ret = devm_pm_runtime_enable(dev);
+    if (ret) {
+        dev_err(dev, "Failed to enable runtime PM: %d\n", ret);
+        goto err_irq;
     }
-    pr_info("gpio_button: %s():%d: chrdev region allocated\n",
-            __func__, __LINE__);
 
-    cdev_init(&c_dev, &fops);
-    if (cdev_add(&c_dev, dev_num, 1)) {
-        ret = -ENODEV;
-        pr_err("GPIO Driver: Failed to Add Cdev\n");
-        goto err_add;
+    // One minor per instance out of the region reserved at module load
+    bdev->id = ida_alloc_max(&gpio_button_ida, GPIO_BUTTON_MAX_DEVICES - 1, GFP_KERNEL);
+    if (bdev->id < 0) {
+        ret = bdev->id;
+        dev_err(dev, "No free gpio_button minor: %d\n", ret);
+        goto err_irq;
     }
-    pr_info("gpio_button: %s():%d: cdev added\n",
-            __func__, __LINE__);
+    bdev->devt = MKDEV(MAJOR(dev_base), MINOR(dev_base) + bdev->id);
 
-    cl = class_create(DRIVER_NAME);
-    if (IS_ERR(cl)) {
-        ret = PTR_ERR(cl);
-        pr_err("gpio_button: %s():%d: Create class error, code: %d\n",
+    spin_lock(&gpio_button_list_lock);
+    list_add_tail(&bdev->node, &gpio_button_list);
+    spin_unlock(&gpio_button_list_lock);
+
+    bdev->c_dev = cdev_alloc();
+    if (!bdev->c_dev) {
+        ret = -ENOMEM;
+        goto err_ida;
+    }
+    bdev->c_dev->ops = &fops;
+    bdev->c_dev->owner = THIS_MODULE;
+    ret = cdev_add(bdev->c_dev, bdev->devt, 1);
+    if (ret) {
+        pr_err("gpio_button: %s():%d: Failed to add cdev, code: %d\n",
                __func__, __LINE__, ret);
-        goto err_class;
+        goto err_cdev;
     }
-    pr_info("gpio_button: %s():%d: Class created\n",
+    pr_info("gpio_button: %s():%d: cdev added\n",
             __func__, __LINE__);
 
-    // Create device for /dev/gpio_button
-    device_create(cl, NULL, dev_num, NULL, "%s", DRIVER_NAME);
-
-    // Create device for sysfs attribute
-    sysfs_dev = device_create(cl, NULL, 0, NULL, "gpio_button_sysfs");
-    if (IS_ERR(sysfs_dev)) {
-        ret = PTR_ERR(sysfs_dev);
-        pr_err("gpio_button: %s():%d: Failed to create sysfs device\n",
+    // Instance 0 keeps the original names so existing apps work unchanged
+    if (bdev->id == 0) {
+        bdev->char_dev = device_create(cl, dev, bdev->devt, bdev, "%s", DRIVER_NAME);
+    } else {
+        bdev->char_dev = device_create(cl, dev, bdev->devt, bdev, "%s%d",
+                                       DRIVER_NAME, bdev->id);
+    }
+    if (IS_ERR(bdev->char_dev)) {
+        ret = PTR_ERR(bdev->char_dev);
+        pr_err("gpio_button: %s():%d: Failed to create char device\n",
                __func__, __LINE__);
-        goto err_sysfs_dev;
+        goto err_cdev;
     }
 
-    // Create sysfs attribute
-    ret = device_create_file(sysfs_dev, &dev_attr_led_status);
-    if (ret) {
-        pr_err("gpio_button: %s():%d: Failed to create sysfs attribute\n",
+    // Create device for sysfs attributes
+    if (bdev->id == 0) {
+        bdev->sysfs_dev = device_create_with_groups(cl, dev, 0, bdev, gpio_button_groups,
+                                                    "%s_sysfs", DRIVER_NAME);
+    } else {
+        bdev->sysfs_dev = device_create_with_groups(cl, dev, 0, bdev, gpio_button_groups,
+                                                    "%s%d_sysfs", DRIVER_NAME, bdev->id);
+    }
+    if (IS_ERR(bdev->sysfs_dev)) {
+        ret = PTR_ERR(bdev->sysfs_dev);
+        pr_err("gpio_button: %s():%d: Failed to create sysfs device\n",
                __func__, __LINE__);
-        goto err_sysfs_attr;
+        goto err_char_dev;
     }
 
-    // Setup button debounce timer.
-    timer_setup(&debounce_timer, debounce_timer_callback, 0);
+    // Named after the instance, so only once it has an id
+    ret = leds_register(dev, bdev);
+    if (ret)
+        goto err_sysfs_dev;
 
-    pr_info("gpio_button: %s():%d: Probe completed successfully\n",
-            __func__, __LINE__);
+    // Without runtime PM nothing else starts the matrix scan; remove stops it
+    if (!IS_ENABLED(CONFIG_PM))
+        gpio_button_runtime_resume(dev);
 
-    return 0;
+    // Complete, open() may find it now
+    mutex_lock(&gpio_button_minors_lock);
+    gpio_button_minors[bdev->id] = bdev;
+    mutex_unlock(&gpio_button_minors_lock);
+
+    pr_info("gpio_button: %s():%d: Probe completed successfully, instance %d\n",
+            __func__, __LINE__, bdev->id);
 
-err_sysfs_attr:
-    device_destroy(cl, 0);
+    return 0;
 
 err_sysfs_dev:
-    device_destroy(cl, dev_num);
+    device_unregister(bdev->sysfs_dev);
 
-err_class:
-    cdev_del(&c_dev);
+err_char_dev:
+    device_destroy(cl, bdev->devt);
 
-err_add:
-    unregister_chrdev_region(dev_num, 1);
+err_cdev:
+    // Also drops the reference of cdev_alloc() when cdev_add() failed
+    cdev_del(bdev->c_dev);
 
-err_alloc:
-    free_irq(irq_number, NULL);
+err_ida:
+    spin_lock(&gpio_button_list_lock);
+    list_del(&bdev->node);
+    spin_unlock(&gpio_button_list_lock);
+    ida_free(&gpio_button_ida, bdev->id);
 
 err_irq:
-    gpiod_put(led_gpio);
-
-err_led:
-    gpiod_put(button_gpio);
+    buttons_disable_irq(bdev);
+    cancel_delayed_work_sync(&bdev->long_press_work);
+    cancel_delayed_work_sync(&bdev->blink_work);
+    device_init_wakeup(dev, false);
     pr_info("gpio_button: %s():%d: Probe failed, code: %d\n",
             __func__, __LINE__, ret);
     return ret;
@@ -297,25 +1981,151 @@ err_led:
 
 static int gpio_remove(struct platform_device *pdev)
 {
-    // Remove sysfs attribute
-    device_remove_file(sysfs_dev, &dev_attr_led_status);
+    struct gpio_button_dev *bdev = platform_get_drvdata(pdev);
+    struct gpio_button_reader *reader;
 
-    // Destroy sysfs device
-    device_destroy(cl, 0);
+    // No new opens; files already open keep bdev but lose the hardware
+    mutex_lock(&gpio_button_minors_lock);
+    gpio_button_minors[bdev->id] = NULL;
+    mutex_unlock(&gpio_button_minors_lock);
 
-    // Destroy /dev/gpio_button device
-    device_destroy(cl, dev_num);
+    /*
+     * Open files hold a runtime PM reference on this binding. Drop them here,
+     * under readers_lock with dead, so a file released after a rebind can't
+     * unbalance the usage count of the new one.
+     */
+    mutex_lock(&bdev->led_lock);
+    spin_lock_bh(&bdev->readers_lock);
+    WRITE_ONCE(bdev->dead, true);
+    list_for_each_entry(reader, &bdev->readers, node)
+        pm_runtime_put_noidle(bdev->dev);
+    spin_unlock_bh(&bdev->readers_lock);
+    mutex_unlock(&bdev->led_lock);
 
-    class_destroy(cl);
-    cdev_del(&c_dev);
-    unregister_chrdev_region(dev_num, 1);
-    free_irq(irq_number, NULL);
-    gpiod_put(button_gpio);
-    gpiod_put(led_gpio);
+    // Stop new events before tearing the instance down, waits for the threads
+    buttons_disable_irq(bdev);
+    // Also the scan probe started itself when CONFIG_PM is off
+    if (bdev->matrix)
+        hrtimer_cancel(&bdev->matrix->scan_timer);
+    cancel_delayed_work_sync(&bdev->long_press_work);
+
+    spin_lock(&gpio_button_list_lock);
+    list_del(&bdev->node);
+    spin_unlock(&gpio_button_list_lock);
+
+    // sysfs devices share devt 0, so unregister by pointer
+    device_unregister(bdev->sysfs_dev);
+    device_destroy(cl, bdev->devt);
+    cdev_del(bdev->c_dev);
+    ida_free(&gpio_button_ida, bdev->id);
+    cancel_delayed_work_sync(&bdev->blink_work);
+    device_init_wakeup(&pdev->dev, false);
+
+    // Blocked readers and pollers see the end of the stream
+    spin_lock_bh(&bdev->readers_lock);
+    list_for_each_entry(reader, &bdev->readers, node)
+        wake_up_all(&reader->wait);
+    spin_unlock_bh(&bdev->readers_lock);
+
+    return 0;
+}
+
+/*
+ * Runtime PM: an instance nobody has open is idle. Edge IRQs cost nothing
+ * while waiting and stay armed for the LED fast path, gestures and stats;
+ * what idles is the matrix scan, which would otherwise wake the CPU every
+ * scan_interval_us.
+ */
+static int gpio_button_runtime_suspend(struct device *dev)
+{
+    struct gpio_button_dev *bdev = dev_get_drvdata(dev);
+
+    if (bdev->matrix)
+        hrtimer_cancel(&bdev->matrix->scan_timer);
+
+    return 0;
+}
+
+static int gpio_button_runtime_resume(struct device *dev)
+{
+    struct gpio_button_dev *bdev = dev_get_drvdata(dev);
+    struct gpio_button_matrix *m = bdev->matrix;
+
+    if (m) {
+        // Keys held while idle are reported as pressed by the first scans
+        memset(m->key_state, 0, sizeof(m->key_state));
+        memset(m->key_count, 0, sizeof(m->key_count));
+        hrtimer_start(&m->scan_timer, us_to_ktime(READ_ONCE(m->scan_interval_us)),
+                      HRTIMER_MODE_REL_SOFT);
+    }
+
+    return 0;
+}
+
+/*
+ * System sleep: with wakeup enabled the button IRQs stay armed so a press
+ * resumes the system and is then reported like any other, otherwise they
+ * are quiesced. led_status is kept and driven again on resume in case the
+ * controllers lost their state.
+ */
+static int gpio_button_suspend(struct device *dev)
+{
+    struct gpio_button_dev *bdev = dev_get_drvdata(dev);
+    unsigned int i;
+
+    bdev->wake_armed = bdev->num_irqs && device_may_wakeup(dev);
+    if (bdev->wake_armed) {
+        for (i = 0; i < bdev->num_irqs; i++)
+            enable_irq_wake(bdev->irqs[i]);
+    } else {
+        buttons_disable_irq(bdev);
+    }
+
+    if (!pm_runtime_status_suspended(dev))
+        gpio_button_runtime_suspend(dev);
+    cancel_delayed_work_sync(&bdev->long_press_work);
+    cancel_delayed_work_sync(&bdev->blink_work);
+
+    return 0;
+}
+
+static int gpio_button_resume(struct device *dev)
+{
+    struct gpio_button_dev *bdev = dev_get_drvdata(dev);
+    unsigned int i;
+
+    mutex_lock(&bdev->led_lock);
+    led_blink_restart(bdev);
+    led_update(bdev, true);
+    mutex_unlock(&bdev->led_lock);
+
+    bdev->resume_time = ktime_get();
+    atomic_set(&bdev->resume_pending, 1);
+    atomic_long_inc(&bdev->stats.resumes);
+
+    if (bdev->wake_armed) {
+        for (i = 0; i < bdev->num_irqs; i++)
+            disable_irq_wake(bdev->irqs[i]);
+    } else {
+        // Changes while asleep went unseen, start from the current state
+        if (bdev->button_gpios)
+            bdev->group_state = group_pressed(bdev);
+        else if (bdev->button_gpio)
+            bdev->pressed = button_pressed(bdev);
+        buttons_enable_irq(bdev);
+    }
+
+    if (!pm_runtime_status_suspended(dev))
+        gpio_button_runtime_resume(dev);
 
     return 0;
 }
 
+static const struct dev_pm_ops gpio_button_pm_ops = {
+    SYSTEM_SLEEP_PM_OPS(gpio_button_suspend, gpio_button_resume)
+    RUNTIME_PM_OPS(gpio_button_runtime_suspend, gpio_button_runtime_resume, NULL)
+};
+
 static const struct of_device_id gpio_button_of_match[] = {
     { .compatible = "custom,gpio-button" },
     { },
@@ -328,10 +2138,54 @@ static struct platform_driver gpio_platform_driver = {
     .driver = {
         .name = DRIVER_NAME,
         .of_match_table = gpio_button_of_match,
+        .pm = pm_ptr(&gpio_button_pm_ops),
     },
 };
 
-module_platform_driver(gpio_platform_driver);
+// The chrdev region and class are shared by every instance
+static int __init gpio_button_init(void)
+{
+    int ret;
+
+    ret = alloc_chrdev_region(&dev_base, 0, GPIO_BUTTON_MAX_DEVICES, DRIVER_NAME);
+    if (ret) {
+        pr_err("gpio_button: %s():%d: Failed to allocate chrdev region\n",
+               __func__, __LINE__);
+        return ret;
+    }
+
+    cl = class_create(DRIVER_NAME);
+    if (IS_ERR(cl)) {
+        ret = PTR_ERR(cl);
+        pr_err("gpio_button: %s():%d: Create class error, code: %d\n",
+               __func__, __LINE__, ret);
+        goto err_class;
+    }
+
+    ret = platform_driver_register(&gpio_platform_driver);
+    if (ret)
+        goto err_driver;
+
+    return 0;
+
+err_driver:
+    class_destroy(cl);
+
+err_class:
+    unregister_chrdev_region(dev_base, GPIO_BUTTON_MAX_DEVICES);
+    return ret;
+}
+
+static void __exit gpio_button_exit(void)
+{
+    platform_driver_unregister(&gpio_platform_driver);
+    class_destroy(cl);
+    unregister_chrdev_region(dev_base, GPIO_BUTTON_MAX_DEVICES);
+    ida_destroy(&gpio_button_ida);
+}
+
+module_init(gpio_button_init);
+module_exit(gpio_button_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Steve Dunnagan");
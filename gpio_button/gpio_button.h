@@ -0,0 +1,116 @@
+/*-----------------------------------------------------------------------------
+ * gpio_button.h
+ *
+ * Userspace interface of the gpio_button driver, shared by the driver and the
+ * apps that read /dev/gpio_button.
+ *-----------------------------------------------------------------------------
+*/
+#ifndef GPIO_BUTTON_H
+#define GPIO_BUTTON_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+// Event types
+#define GPIO_BUTTON_EV_PRESS        1
+#define GPIO_BUTTON_EV_RELEASE      2
+// Gestures, recognized by the driver when configured (sysfs or DT)
+#define GPIO_BUTTON_EV_LONG_PRESS   3   // still held long_press_ms after the press
+#define GPIO_BUTTON_EV_DOUBLE_CLICK 4   // press within double_click_ms of a release
+#define GPIO_BUTTON_EV_CHORD        5   // instances of one chord_group held together
+// Grouped mode (several button-gpios): value is the pressed bitmap, bit n is
+// the n-th line, one record per debounced change of any line
+#define GPIO_BUTTON_EV_GROUP        6
+// Matrix keypad mode (row-gpios/col-gpios): value is the key number,
+// row * number of columns + column
+#define GPIO_BUTTON_EV_KEY_PRESS    7
+#define GPIO_BUTTON_EV_KEY_RELEASE  8
+
+// Event flags
+#define GPIO_BUTTON_EVF_LED_TOGGLED (1 << 0)    // driver already toggled the LED
+
+/*
+ * Fixed-size record returned by read(). read() returns as many whole records
+ * as fit in the buffer, a buffer smaller than one record is rejected.
+ */
+struct gpio_button_event {
+    __u64 timestamp_ns;     // CLOCK_MONOTONIC time of the edge, from the hard IRQ
+    __u32 seq;              // per-device sequence number, a gap means lost events
+    __u32 type;             // GPIO_BUTTON_EV_*
+    __u32 duration_us;      // time from the edge until it was debounced/recognized
+    __u32 value;            // debounced button state, 1 = pressed; for CHORD
+                            // a bitmask of the instance numbers held, for
+                            // GROUP the bitmap of lines held, for KEY_*
+                            // the key number
+    __u32 hold_us;          // (key) releases, long presses: time since the press
+    __u32 flags;            // GPIO_BUTTON_EVF_*
+};
+
+/*
+ * Event ring shared by every reader of a device, mapped read-only with
+ * mmap() at GPIO_BUTTON_OFF_RING (GPIO_BUTTON_RING_SIZE bytes). The driver
+ * writes a record and then advances head with release semantics; a record's
+ * seq is its ring index. The ring never blocks the driver, the oldest record
+ * is overwritten instead.
+ *
+ * Each open file has its own cursor, mappable read-write at
+ * GPIO_BUTTON_OFF_CURSOR. read() consumes from it; an mmap consumer reads
+ * records from tail up to head (load with acquire), then re-reads head and
+ * discards any record i with head - i >= entries, which may have been
+ * overwritten while it was copied. It then stores the new tail, which is
+ * what poll() compares against head to decide whether to wake it. poll()
+ * also reports POLLPRI while head - tail > entries, i.e. records were lost.
+ */
+#define GPIO_BUTTON_RING_ENTRIES 256    // power of two
+
+struct gpio_button_ring {
+    __u32 head;             // written by the driver
+    __u32 entries;          // GPIO_BUTTON_RING_ENTRIES
+    __u32 pad[14];
+    struct gpio_button_event events[];
+};
+
+struct gpio_button_cursor {
+    __u32 tail;             // next record this reader will consume
+    __u32 lost;             // records overwritten before read() got to them
+};
+
+#define GPIO_BUTTON_RING_SIZE \
+    (sizeof(struct gpio_button_ring) + \
+     GPIO_BUTTON_RING_ENTRIES * sizeof(struct gpio_button_event))
+
+// mmap() offsets
+#define GPIO_BUTTON_OFF_RING    0x0
+#define GPIO_BUTTON_OFF_CURSOR  0x100000
+
+// LED operations for GPIO_BUTTON_IOC_LED
+#define GPIO_BUTTON_LED_GET     0
+#define GPIO_BUTTON_LED_CLEAR   1
+#define GPIO_BUTTON_LED_SET     2
+#define GPIO_BUTTON_LED_TOGGLE  3
+
+struct gpio_button_led {
+    __u32 op;               // GPIO_BUTTON_LED_*
+    __u32 value;            // out: LED state after the operation
+};
+
+/*
+ * Per open file event filter for GPIO_BUTTON_IOC_FILTER. Records it rejects
+ * are skipped by read() and never wake the file. It applies to records
+ * published after the call; mmap consumers still see the whole ring.
+ */
+#define GPIO_BUTTON_EV_BIT(type)    (1U << (type))
+
+struct gpio_button_filter {
+    __u32 type_mask;        // GPIO_BUTTON_EV_BIT()s to deliver, 0 = all types
+    __u32 rate_limit_ms;    // deliver at most one record per this many ms of publish time, 0 = off
+};
+
+#define GPIO_BUTTON_IOC_MAGIC   'B'
+
+// Set, clear, toggle or read the LED in one call on /dev/gpio_button
+#define GPIO_BUTTON_IOC_LED     _IOWR(GPIO_BUTTON_IOC_MAGIC, 1, struct gpio_button_led)
+// Replace this file's event filter
+#define GPIO_BUTTON_IOC_FILTER  _IOW(GPIO_BUTTON_IOC_MAGIC, 2, struct gpio_button_filter)
+
+#endif // GPIO_BUTTON_H
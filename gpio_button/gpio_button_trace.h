@@ -0,0 +1,153 @@
+/*-----------------------------------------------------------------------------
+ * gpio_button_trace.h
+ *
+ * Tracepoints along the gpio_button press path: hard IRQ -> debounce ->
+ * reader wakeup -> read(), plus every LED change. Enable them with
+ * trace-cmd/perf under the gpio_button system.
+ *-----------------------------------------------------------------------------
+*/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM gpio_button
+
+#if !defined(GPIO_BUTTON_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define GPIO_BUTTON_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// Every edge seen by the hard handler, rejected while debouncing
+TRACE_EVENT(gpio_button_irq,
+
+    TP_PROTO(int id, ktime_t edge_time, bool rejected),
+
+    TP_ARGS(id, edge_time, rejected),
+
+    TP_STRUCT__entry(
+        __field(int, id)
+        __field(s64, edge_ns)
+        __field(bool, rejected)
+    ),
+
+    TP_fast_assign(
+        __entry->id = id;
+        __entry->edge_ns = ktime_to_ns(edge_time);
+        __entry->rejected = rejected;
+    ),
+
+    TP_printk("id=%d edge_ns=%lld rejected=%d",
+              __entry->id, __entry->edge_ns, __entry->rejected)
+);
+
+// A record published to the ring: a debounced state change or a gesture
+TRACE_EVENT(gpio_button_debounce,
+
+    TP_PROTO(int id, const struct gpio_button_event *ev),
+
+    TP_ARGS(id, ev),
+
+    TP_STRUCT__entry(
+        __field(int, id)
+        __field(u32, seq)
+        __field(u32, type)
+        __field(u64, edge_ns)
+        __field(u32, duration_us)
+        __field(u32, flags)
+    ),
+
+    TP_fast_assign(
+        __entry->id = id;
+        __entry->seq = ev->seq;
+        __entry->type = ev->type;
+        __entry->edge_ns = ev->timestamp_ns;
+        __entry->duration_us = ev->duration_us;
+        __entry->flags = ev->flags;
+    ),
+
+    TP_printk("id=%d seq=%u %s edge_ns=%llu duration_us=%u flags=0x%x",
+              __entry->id, __entry->seq,
+              __print_symbolic(__entry->type,
+                               { GPIO_BUTTON_EV_PRESS, "press" },
+                               { GPIO_BUTTON_EV_RELEASE, "release" },
+                               { GPIO_BUTTON_EV_LONG_PRESS, "long_press" },
+                               { GPIO_BUTTON_EV_DOUBLE_CLICK, "double_click" },
+                               { GPIO_BUTTON_EV_CHORD, "chord" },
+                               { GPIO_BUTTON_EV_GROUP, "group" },
+                               { GPIO_BUTTON_EV_KEY_PRESS, "key_press" },
+                               { GPIO_BUTTON_EV_KEY_RELEASE, "key_release" }),
+              __entry->edge_ns, __entry->duration_us, __entry->flags)
+);
+
+// Readers woken for the record with this sequence number
+TRACE_EVENT(gpio_button_wakeup,
+
+    TP_PROTO(int id, u32 seq),
+
+    TP_ARGS(id, seq),
+
+    TP_STRUCT__entry(
+        __field(int, id)
+        __field(u32, seq)
+    ),
+
+    TP_fast_assign(
+        __entry->id = id;
+        __entry->seq = seq;
+    ),
+
+    TP_printk("id=%d seq=%u", __entry->id, __entry->seq)
+);
+
+// A batch of records handed to a reader by read()
+TRACE_EVENT(gpio_button_read,
+
+    TP_PROTO(int id, const struct gpio_button_event *batch, u32 count),
+
+    TP_ARGS(id, batch, count),
+
+    TP_STRUCT__entry(
+        __field(int, id)
+        __field(u32, first_seq)
+        __field(u32, count)
+        __field(u64, edge_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->id = id;
+        __entry->first_seq = batch[0].seq;
+        __entry->count = count;
+        __entry->edge_ns = batch[0].timestamp_ns;
+    ),
+
+    TP_printk("id=%d seq=%u count=%u edge_ns=%llu",
+              __entry->id, __entry->first_seq, __entry->count, __entry->edge_ns)
+);
+
+// Any GPIO_BUTTON_LED_* operation that changed the LED, from any path
+TRACE_EVENT(gpio_button_led,
+
+    TP_PROTO(int id, u32 op, int state),
+
+    TP_ARGS(id, op, state),
+
+    TP_STRUCT__entry(
+        __field(int, id)
+        __field(u32, op)
+        __field(int, state)
+    ),
+
+    TP_fast_assign(
+        __entry->id = id;
+        __entry->op = op;
+        __entry->state = state;
+    ),
+
+    TP_printk("id=%d op=%u state=%d", __entry->id, __entry->op, __entry->state)
+);
+
+#endif /* GPIO_BUTTON_TRACE_H */
+
+// The header lives next to the driver, not in include/trace/events
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE gpio_button_trace
+#include <trace/define_trace.h>